@@ -0,0 +1,325 @@
+#include "chunkfile.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Measures the speed of Chunkfile and the space it uses. Every result is
+// printed as one JSON object per line, so results of different versions
+// can be compared with scripts. Usage: bench [--quick] [--mmap] [path]
+
+typedef std::chrono::steady_clock Clock;
+
+// How big chunks are
+enum SizeDistribution
+{
+    SIZES_SMALL,
+    SIZES_MIXED,
+    SIZES_LARGE
+};
+
+// How chunk IDs are chosen
+enum IdPattern
+{
+    IDS_DENSE,
+    IDS_SPARSE,
+    IDS_RANDOM
+};
+
+std::string getSizesName(SizeDistribution sizes)
+{
+    switch (sizes) {
+    case SIZES_SMALL:
+        return "small";
+    case SIZES_MIXED:
+        return "mixed";
+    case SIZES_LARGE:
+        return "large";
+    }
+    return "";
+}
+
+std::string getIdsName(IdPattern ids)
+{
+    switch (ids) {
+    case IDS_DENSE:
+        return "dense";
+    case IDS_SPARSE:
+        return "sparse";
+    case IDS_RANDOM:
+        return "random";
+    }
+    return "";
+}
+
+uint64_t getAverageChunkSize(SizeDistribution sizes)
+{
+    switch (sizes) {
+    case SIZES_SMALL:
+        return 100;
+    case SIZES_MIXED:
+        return 8 * 1024;
+    case SIZES_LARGE:
+        return 640 * 1024;
+    }
+    return 0;
+}
+
+uint64_t getRandomChunkSize(SizeDistribution sizes, std::mt19937_64& random)
+{
+    switch (sizes) {
+    case SIZES_SMALL:
+        return 100;
+    case SIZES_MIXED:
+        // Logarithmically distributed between 64 bytes and 64 KB
+        return uint64_t(64 * std::pow(2.0, std::uniform_real_distribution<double>(0, 10)(random)));
+    case SIZES_LARGE:
+        return std::uniform_int_distribution<uint64_t>(256 * 1024, 1024 * 1024)(random);
+    }
+    return 0;
+}
+
+std::vector<uint64_t> getChunkIds(IdPattern ids, uint64_t chunks, std::mt19937_64& random)
+{
+    std::vector<uint64_t> result;
+    switch (ids) {
+    case IDS_DENSE:
+        for (uint64_t i = 0; i < chunks; ++ i) {
+            result.push_back(i);
+        }
+        break;
+    case IDS_SPARSE:
+        for (uint64_t i = 0; i < chunks; ++ i) {
+            result.push_back(i * 16);
+        }
+        break;
+    case IDS_RANDOM:
+        // Random order, with some gaps
+        for (uint64_t i = 0; i < chunks * 4; ++ i) {
+            result.push_back(i);
+        }
+        std::shuffle(result.begin(), result.end(), random);
+        result.resize(chunks);
+        break;
+    }
+    return result;
+}
+
+uint64_t getFileSize(std::string const& path)
+{
+    std::ifstream f(path.c_str(), std::ios::binary | std::ios::ate);
+    return f.tellg();
+}
+
+double getMicroseconds(Clock::time_point begin, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::micro>(end - begin).count();
+}
+
+double getPercentile(std::vector<double> latencies, double percentile)
+{
+    if (latencies.empty()) {
+        return 0;
+    }
+    size_t index = std::min<size_t>(latencies.size() * percentile, latencies.size() - 1);
+    std::nth_element(latencies.begin(), latencies.begin() + index, latencies.end());
+    return latencies[index];
+}
+
+// Prints the results of one operation as JSON
+void printOperation(std::string const& sizes, std::string const& ids, uint64_t data_size, std::string const& operation, std::vector<double> const& latencies, uint64_t bytes)
+{
+    double total_us = 0;
+    for (double latency : latencies) {
+        total_us += latency;
+    }
+    std::ostringstream out;
+    out << "{\"benchmark\":\"operations\"";
+    out << ",\"sizes\":\"" << sizes << "\"";
+    out << ",\"ids\":\"" << ids << "\"";
+    out << ",\"data_size\":" << data_size;
+    out << ",\"operation\":\"" << operation << "\"";
+    out << ",\"count\":" << latencies.size();
+    out << ",\"ops_per_second\":" << (total_us > 0 ? latencies.size() / total_us * 1e6 : 0);
+    out << ",\"mb_per_second\":" << (total_us > 0 ? bytes / total_us : 0);
+    out << ",\"p50_us\":" << getPercentile(latencies, 0.5);
+    out << ",\"p99_us\":" << getPercentile(latencies, 0.99);
+    out << "}";
+    std::cout << out.str() << std::endl;
+}
+
+// Sets, gets and deletes chunks, and measures every operation
+void benchmarkOperations(std::string const& path, Chunkfile::Options const& options, SizeDistribution sizes, IdPattern ids, uint64_t data_size)
+{
+    std::mt19937_64 random(1);
+    uint64_t chunks = std::max<uint64_t>(data_size / getAverageChunkSize(sizes), 1);
+    std::vector<uint64_t> chunk_ids = getChunkIds(ids, chunks, random);
+    std::vector<uint64_t> chunk_sizes;
+    for (uint64_t i = 0; i < chunks; ++ i) {
+        chunk_sizes.push_back(getRandomChunkSize(sizes, random));
+    }
+    Chunkfile::Bytes bytes(*std::max_element(chunk_sizes.begin(), chunk_sizes.end()));
+    for (size_t i = 0; i < bytes.size(); ++ i) {
+        bytes[i] = random();
+    }
+
+    ::remove(path.c_str());
+    Chunkfile file(path, options);
+    std::vector<double> latencies;
+    latencies.reserve(chunks);
+    uint64_t total_bytes = 0;
+
+    for (uint64_t i = 0; i < chunks; ++ i) {
+        Clock::time_point begin = Clock::now();
+        file.set(chunk_ids[i], bytes.data(), chunk_sizes[i]);
+        latencies.push_back(getMicroseconds(begin, Clock::now()));
+        total_bytes += chunk_sizes[i];
+    }
+    file.sync();
+    printOperation(getSizesName(sizes), getIdsName(ids), data_size, "set", latencies, total_bytes);
+
+    // Read and delete in random order
+    std::vector<size_t> order;
+    for (size_t i = 0; i < chunks; ++ i) {
+        order.push_back(i);
+    }
+    std::shuffle(order.begin(), order.end(), random);
+
+    latencies.clear();
+    Chunkfile::Bytes result;
+    for (size_t i : order) {
+        Clock::time_point begin = Clock::now();
+        file.get(result, chunk_ids[i]);
+        latencies.push_back(getMicroseconds(begin, Clock::now()));
+    }
+    printOperation(getSizesName(sizes), getIdsName(ids), data_size, "get", latencies, total_bytes);
+
+    latencies.clear();
+    for (size_t i : order) {
+        Clock::time_point begin = Clock::now();
+        file.del(chunk_ids[i]);
+        latencies.push_back(getMicroseconds(begin, Clock::now()));
+    }
+    file.sync();
+    printOperation(getSizesName(sizes), getIdsName(ids), data_size, "del", latencies, total_bytes);
+}
+
+// Replaces and removes random chunks for a while, and then
+// reports how much the file has grown, how much of it is free
+// space, and how long it takes to optimize it.
+void benchmarkChurn(std::string const& path, Chunkfile::Options const& options, SizeDistribution sizes, uint64_t data_size)
+{
+    std::mt19937_64 random(2);
+    uint64_t chunks = std::max<uint64_t>(data_size / getAverageChunkSize(sizes), 1);
+    Chunkfile::Bytes bytes(getAverageChunkSize(sizes) * 16);
+    for (size_t i = 0; i < bytes.size(); ++ i) {
+        bytes[i] = random();
+    }
+
+    ::remove(path.c_str());
+    Chunkfile file(path, options);
+    std::map<uint64_t, uint64_t> chunk_sizes;
+    uint64_t live_bytes = 0;
+    for (uint64_t chunk_id = 0; chunk_id < chunks; ++ chunk_id) {
+        uint64_t size = std::min<uint64_t>(getRandomChunkSize(sizes, random), bytes.size());
+        file.set(chunk_id, bytes.data(), size);
+        chunk_sizes[chunk_id] = size;
+        live_bytes += size;
+    }
+
+    uint64_t operations = chunks * 4;
+    Clock::time_point begin = Clock::now();
+    for (uint64_t i = 0; i < operations; ++ i) {
+        uint64_t chunk_id = random() % (chunks * 2);
+        std::map<uint64_t, uint64_t>::iterator it = chunk_sizes.find(chunk_id);
+        bool exists = it != chunk_sizes.end();
+        if (exists) {
+            live_bytes -= it->second;
+            chunk_sizes.erase(it);
+        }
+        if (random() % 2 == 0) {
+            uint64_t size = std::min<uint64_t>(getRandomChunkSize(sizes, random), bytes.size());
+            file.set(chunk_id, bytes.data(), size);
+            chunk_sizes[chunk_id] = size;
+            live_bytes += size;
+        } else if (exists) {
+            file.del(chunk_id);
+        }
+    }
+    file.sync();
+    double churn_us = getMicroseconds(begin, Clock::now());
+    uint64_t file_size = getFileSize(path);
+    Chunkfile::Stats stats = file.getStats();
+
+    begin = Clock::now();
+    file.optimize();
+    file.sync();
+    double optimize_us = getMicroseconds(begin, Clock::now());
+    uint64_t optimized_file_size = getFileSize(path);
+    Chunkfile::Stats optimized_stats = file.getStats();
+
+    std::ostringstream out;
+    out << "{\"benchmark\":\"churn\"";
+    out << ",\"sizes\":\"" << getSizesName(sizes) << "\"";
+    out << ",\"data_size\":" << data_size;
+    out << ",\"operations\":" << operations;
+    out << ",\"ops_per_second\":" << (churn_us > 0 ? operations / churn_us * 1e6 : 0);
+    out << ",\"chunks\":" << chunk_sizes.size();
+    out << ",\"live_bytes\":" << live_bytes;
+    out << ",\"file_size\":" << file_size;
+    out << ",\"overhead\":" << (live_bytes > 0 ? double(file_size) / live_bytes : 0);
+    out << ",\"empty_space\":" << stats.empty_space;
+    out << ",\"fragmentation\":" << stats.fragmentation;
+    out << ",\"optimize_ms\":" << optimize_us / 1000;
+    out << ",\"optimized_file_size\":" << optimized_file_size;
+    out << ",\"optimized_empty_space\":" << optimized_stats.empty_space;
+    out << ",\"optimized_fragmentation\":" << optimized_stats.fragmentation;
+    out << "}";
+    std::cout << out.str() << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    bool quick = false;
+    Chunkfile::Options options;
+    std::string path = "/tmp/chunkfile_bench";
+    for (int i = 1; i < argc; ++ i) {
+        if (std::string(argv[i]) == "--quick") {
+            quick = true;
+        } else if (std::string(argv[i]) == "--mmap") {
+            options.backend = Chunkfile::Options::BACKEND_MMAP;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    std::vector<uint64_t> data_sizes;
+    data_sizes.push_back(quick ? 1024 * 1024 : 4 * 1024 * 1024);
+    data_sizes.push_back(quick ? 8 * 1024 * 1024 : 64 * 1024 * 1024);
+
+    SizeDistribution const all_sizes[] = {SIZES_SMALL, SIZES_MIXED, SIZES_LARGE};
+    IdPattern const all_ids[] = {IDS_DENSE, IDS_SPARSE, IDS_RANDOM};
+    for (uint64_t data_size : data_sizes) {
+        for (SizeDistribution sizes : all_sizes) {
+            for (IdPattern ids : all_ids) {
+                benchmarkOperations(path, options, sizes, ids, data_size);
+            }
+        }
+    }
+    for (uint64_t data_size : data_sizes) {
+        for (SizeDistribution sizes : all_sizes) {
+            benchmarkChurn(path, options, sizes, data_size);
+        }
+    }
+
+    ::remove(path.c_str());
+    return EXIT_SUCCESS;
+}
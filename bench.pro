@@ -0,0 +1,11 @@
+TEMPLATE = app
+CONFIG += console c++11 thread
+CONFIG -= app_bundle
+CONFIG -= qt
+
+SOURCES += \
+    bench.cpp \
+    chunkfile.cpp
+
+HEADERS += \
+    chunkfile.hpp
@@ -1,32 +1,173 @@
 #include "chunkfile.hpp"
 
-Chunkfile::Chunkfile(std::string const& path)
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHUNKFILE_SSE42
+#include <nmmintrin.h>
+#endif
+
+uint64_t const Chunkfile::MINUS_ONE;
+
+// Locks the Chunkfile for reading or writing. If the thread
+// already has the write lock, then nothing needs to be done.
+class Chunkfile::Lock
+{
+public:
+    inline Lock(Chunkfile* chunkfile, bool write) :
+        chunkfile(NULL),
+        write(write)
+    {
+        if (chunkfile->write_lock_owner.load() == std::this_thread::get_id()) {
+            return;
+        }
+        if (write) {
+            pthread_rwlock_wrlock(&chunkfile->rwlock);
+            chunkfile->write_lock_owner.store(std::this_thread::get_id());
+        } else {
+            pthread_rwlock_rdlock(&chunkfile->rwlock);
+        }
+        this->chunkfile = chunkfile;
+    }
+    inline ~Lock()
+    {
+        if (chunkfile) {
+            if (write) {
+                chunkfile->write_lock_owner.store(std::thread::id());
+            }
+            pthread_rwlock_unlock(&chunkfile->rwlock);
+        }
+    }
+private:
+    Chunkfile* chunkfile;
+    bool write;
+};
+
+// Makes sure every modification happens inside a transaction. If an
+// exception is thrown, the whole ongoing transaction is rolled back,
+// so the partial modification is never committed.
+class Chunkfile::TransactionGuard
+{
+public:
+    inline TransactionGuard(Chunkfile* chunkfile) :
+        chunkfile(chunkfile)
+    {
+        chunkfile->begin();
+    }
+    inline ~TransactionGuard()
+    {
+        if (chunkfile && chunkfile->options.write_ahead_log) {
+            -- chunkfile->transaction_depth;
+            // Modifications done before this one in the outer
+            // transaction are thrown away too, so it fails.
+            chunkfile->transaction_failed = chunkfile->transaction_depth > 0;
+            try {
+                chunkfile->rollback();
+            }
+            catch ( ... ) {
+            }
+        }
+    }
+    inline void commit()
+    {
+        Chunkfile* chunkfile_to_commit = chunkfile;
+        chunkfile = NULL;
+        chunkfile_to_commit->commit();
+    }
+private:
+    Chunkfile* chunkfile;
+};
+
+Chunkfile::Chunkfile(std::string const& path, Options const& options) :
+    Chunkfile(createBackend(path, options), options.backend == Options::BACKEND_MEMORY ? std::string() : path, options)
+{
+}
+
+Chunkfile::Chunkfile(Backend* backend, Options const& options) :
+    Chunkfile(backend, std::string(), options)
+{
+}
+
+Chunkfile::Chunkfile(Backend* backend, std::string const& path, Options const& options) :
+    options(options),
+    backend(backend),
+    write_lock_owner(std::thread::id()),
+    read_pos(0),
+    write_pos(0),
+    free_ids_loaded(false),
+    async_stopping(false),
+    async_pos(0),
+    wal_path(path.empty() ? std::string() : path + ".wal"),
+    wal_fd(-1),
+    wal_size(0),
+    wal_buffered_commits(0),
+    transaction_depth(0),
+    transaction_failed(false),
+    transaction_truncate(MINUS_ONE),
+    pending_writes_size(0),
+    pending_truncate(MINUS_ONE),
+    applied_file_size(0),
+    stat_reads(0),
+    stat_writes(0),
+    stat_seeks(0),
+    stat_bytes_read(0),
+    stat_bytes_written(0),
+    stat_io_end(0),
+    stat_bytes_set(0),
+    stat_data_part_moves(0),
+    stat_reserve_growths(0),
+    stat_optimizations(0),
+    stat_bytes_deduplicated(0)
 {
+    pthread_rwlock_init(&rwlock, NULL);
     buf = new uint8_t[BUF_SIZE];
 
     try {
-        // Make sure the file exists
-// TODO: This is needed because std::ios::app and .seekp() does not work together. And if std::ios::app is not used, then file is not created. Find more elegant way of doing this!
-        file.open(path, std::ios::binary | std::ios::out | std::ios::app);
-        file.close();
-
-        // Open
-        file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+        // If program crashed while the file was being modified, then
+        // finish the modifications that were committed to the log.
+        if (!wal_path.empty()) {
+            recoverWriteAheadLog();
+        }
+        if (options.write_ahead_log) {
+            if (wal_path.empty()) {
+                throw std::runtime_error("Write ahead log needs a path to file!");
+            }
+            wal_fd = ::open(wal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (wal_fd < 0) {
+                throw std::runtime_error("Unable to open write ahead log!");
+            }
+        }
 
         // Get size
-        file.seekg(0, std::ios::end);
-        file_size = file.tellg();
-        file.seekg(0);
+        file_size = backend->getSize();
+        applied_file_size = file_size;
 
         // If file is new
         if (file_size == 0) {
+            begin();
             chunks = 0;
             chunk_space_reserved = 0;
             total_data_part_empty_space = 0;
+            if (options.deduplication) {
+                version = options.sparse_ids ? VERSION_SPARSE_IDS_AND_DEDUPLICATION : VERSION_DEDUPLICATION;
+            } else {
+                version = options.sparse_ids ? VERSION_SPARSE_IDS : VERSION;
+            }
+            datapart_header_size = DATAPART_HEADER_SIZE_V1;
+            writeSeek(0);
             writeString("CHUNKFILE");
-            writeUInt64(0);
+            writeUInt64(version);
             writeHeader();
             file_size = HEADER_SIZE;
+            commit();
         }
         // If file already exists
         else {
@@ -35,37 +176,82 @@ Chunkfile::Chunkfile(std::string const& path)
             }
             // Read header
             std::string magic;
+            readSeek(0);
             readString(magic, 9);
             if (magic != "CHUNKFILE") {
                 throw CorruptedFile();
             }
-            uint64_t version = readUInt64();
-            if (version != 0) {
+            version = readUInt64();
+            if (version > VERSION_SPARSE_IDS_AND_DEDUPLICATION) {
                 throw UnsupportedVersion();
             }
-            chunks = readUInt64();
-            chunk_space_reserved = readUInt64();
-            total_data_part_empty_space = readUInt64();
+            datapart_header_size = version == 0 ? DATAPART_HEADER_SIZE_V0 : DATAPART_HEADER_SIZE_V1;
+            readHeader();
         }
     }
     catch ( ... ) {
+        if (wal_fd >= 0) {
+            ::close(wal_fd);
+        }
+        delete backend;
         delete[] buf;
+        pthread_rwlock_destroy(&rwlock);
         throw;
     }
 }
 
 Chunkfile::~Chunkfile()
 {
-    file.close();
+    stopAsyncThreads();
+
+    if (!options.write_ahead_log) {
+        try {
+            applyPendingWrites();
+        }
+        catch ( ... ) {
+        }
+    } else {
+        try {
+            // Store everything that has been committed. If there is
+            // an ongoing transaction, then the log is left to be
+            // recovered when the file is opened next time.
+            writeWriteAheadLog();
+            if (transaction_depth == 0) {
+                applyPendingWrites();
+                backend->sync();
+                ::unlink(wal_path.c_str());
+            }
+        }
+        catch ( ... ) {
+        }
+        ::close(wal_fd);
+    }
+    delete backend;
     delete[] buf;
+    pthread_rwlock_destroy(&rwlock);
 }
 
 void Chunkfile::reserve(uint64_t new_reserve)
+{
+    Lock lock(this, true);
+
+    // Hash table is kept at most half full
+    if (hasSparseIds()) {
+        growHeaderArea(new_reserve * 2 * HEADERPARTS_PER_SLOT);
+    } else {
+        growHeaderArea(new_reserve);
+    }
+}
+
+void Chunkfile::growHeaderArea(uint64_t new_reserve)
 {
     if (chunk_space_reserved >= new_reserve) {
         return;
     }
 
+    TransactionGuard transaction(this);
+    ++ stat_reserve_growths;
+
     uint64_t data_area_begin = HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE;
     uint64_t new_data_area_begin = HEADER_SIZE + new_reserve * HEADERPART_SIZE;
     uint64_t new_space_needed = new_data_area_begin - data_area_begin;
@@ -95,6 +281,7 @@ void Chunkfile::reserve(uint64_t new_reserve)
         if (chunk_type == DATAPART_TYPE_FREESPACE && chunk_size == new_space_needed) {
             assert(total_data_part_empty_space >= new_space_needed);
             total_data_part_empty_space -= new_space_needed;
+            removeFreeSpace(data_area_begin);
             break;
         }
 
@@ -126,6 +313,9 @@ void Chunkfile::reserve(uint64_t new_reserve)
                 if (next_chunk_type == DATAPART_TYPE_FREESPACE) {
                     writeSeek(data_area_begin);
                     writeUInt63AndUInt1(chunk_size + next_chunk_size, DATAPART_TYPE_FREESPACE);
+                    removeFreeSpace(next_chunk_pos);
+                    removeFreeSpace(data_area_begin);
+                    addFreeSpace(data_area_begin, chunk_size + next_chunk_size);
                     continue;
                 }
             }
@@ -140,11 +330,13 @@ void Chunkfile::reserve(uint64_t new_reserve)
             // If this is the last data part, then it can be easily grown
             if (next_chunk_pos == file_size) {
                 uint64_t size_increase = new_space_needed + DATAPART_FREESPACE_MIN_SIZE - chunk_size;
-                writeSeek(file_size);
-                writeUnexpected(size_increase);
+                extendFile(file_size + size_increase);
                 writeSeek(data_area_begin);
                 writeUInt63AndUInt1(chunk_size + size_increase, DATAPART_TYPE_FREESPACE);
+                file_size += size_increase;
                 total_data_part_empty_space += size_increase;
+                removeFreeSpace(data_area_begin);
+                addFreeSpace(data_area_begin, chunk_size + size_increase);
                 continue;
             }
             // Read the next data part after the free space
@@ -173,364 +365,3672 @@ throw std::runtime_error("This should not be reached!");
         writeUInt63AndUInt1(chunk_new_size, DATAPART_TYPE_FREESPACE);
         assert(total_data_part_empty_space >= new_space_needed);
         total_data_part_empty_space -= new_space_needed;
+        removeFreeSpace(data_area_begin);
+        addFreeSpace(new_data_area_begin, chunk_new_size);
     }
 
-    // Initialize new header parts
-    writeSeek(data_area_begin);
-    for (uint64_t chunk_id = chunk_space_reserved; chunk_id < new_reserve; ++ chunk_id) {
-        writeUInt64(MINUS_ONE);
+    // Initialize new header parts. With sparse IDs, the
+    // chunks are moved to their slots in the bigger table.
+    if (hasSparseIds()) {
+        rehashSlots(new_reserve);
+    } else {
+        writeSeek(data_area_begin);
+        for (uint64_t chunk_id = chunk_space_reserved; chunk_id < new_reserve; ++ chunk_id) {
+            writeUInt64(MINUS_ONE);
+        }
+        if (options.cache_header_parts) {
+            header_parts.resize(new_reserve, MINUS_ONE);
+        }
+    }
+    if (free_ids_loaded) {
+        for (uint64_t chunk_id = chunk_space_reserved; chunk_id < new_reserve; ++ chunk_id) {
+            free_ids.insert(free_ids.end(), chunk_id);
+        }
     }
 
     chunk_space_reserved = new_reserve;
     writeHeader();
+
+    transaction.commit();
 }
 
 bool Chunkfile::exists(uint64_t chunk_id)
 {
-    if (chunk_id >= chunk_space_reserved) {
+    Lock lock(this, false);
+
+    if (!hasSparseIds() && chunk_id >= chunk_space_reserved) {
         return false;
     }
 
-    readSeek(HEADER_SIZE + HEADERPART_SIZE * chunk_id);
-    uint64_t datapart_pos = readUInt64();
-    return datapart_pos != MINUS_ONE;
+    return readHeaderPart(chunk_id) != MINUS_ONE;
 }
 
 void Chunkfile::set(uint64_t chunk_id, uint8_t const* bytes, uint64_t size)
 {
-    // If more chunk space needs to be allocated
-    if (chunk_id >= chunk_space_reserved) {
-        reserve(std::max(chunk_id + 1, chunk_space_reserved * 2));
+    if (chunk_id == MINUS_ONE) {
+        throw std::runtime_error("Chunk ID 2^64-1 is reserved!");
     }
 
-    // If old chunk needs to be cleared first
-    if (exists(chunk_id)) {
-        del(chunk_id);
+    Lock lock(this, true);
+    TransactionGuard transaction(this);
+    stat_bytes_set += size;
+
+    DataPartHeader header;
+    header.chunk_id = chunk_id;
+    header.contents_size = size;
+    header.codec = CODEC_NONE;
+    header.flags = getNewDataPartFlags();
+
+    // Reference to shared contents is added before the old one is
+    // released, so contents that stay the same are not freed. Contents
+    // that are not shared are hashed, unless other contents have the
+    // same hash already.
+    Bytes compressed;
+    uint8_t reference[REFERENCE_SIZE];
+    uint64_t hash = 0;
+    bool shared = false;
+    if (hasDeduplication() && size >= DEDUPLICATION_MIN_SIZE) {
+        hash = calculateContentHash(bytes, size);
+        shared = addReference(chunk_id, hash, bytes, size);
+        encodeUInt64(reference, hash);
+        std::map<uint64_t, uint64_t>::const_iterator hashed_contents_find = hashed_contents.find(hash);
+        if (!shared && (hashed_contents_find == hashed_contents.end() || hashed_contents_find->second == chunk_id)) {
+            header.flags |= FLAG_HASHED;
+        }
+    }
+    if (shared) {
+        bytes = reference;
+        header.contents_size = REFERENCE_SIZE;
+        header.flags |= FLAG_REFERENCE;
+    } else if (options.compression == Options::COMPRESSION_LZ4 && version > 0 && compressContents(compressed, bytes, size)) {
+        bytes = &compressed[0];
+        header.contents_size = compressed.size();
+        header.codec = CODEC_LZ4;
+    }
+    if (version > 0 && header.contents_size > MAX_CONTENTS_SIZE) {
+        throw std::runtime_error("Chunk is too big!");
     }
 
-    // Get properties of new data part
-    uint64_t datapart_size = DATAPART_DATA_MIN_SIZE + size;
-    uint64_t datapart_pos = findFreeSpace(size);
-    uint64_t datapart_end_pos = datapart_pos + datapart_size;
-
-    // Check if there is an existing data part here. Should be empty if there is.
-    if (datapart_pos < file_size) {
-        // Read existing data part
-        readSeek(datapart_pos);
-        uint64_t free_space_size;
-        uint8_t free_space_type;
-        readUInt63AndUInt1(free_space_size, free_space_type);
-        assert(free_space_type == DATAPART_TYPE_FREESPACE);
-        // "Move" it after the new data part, if there is space
-        if (datapart_end_pos > file_size) {
-            throw CorruptedFile();
+    // If old chunk exists, then try to overwrite it in place
+    if (exists(chunk_id)) {
+        uint64_t datapart_pos = readHeaderPart(chunk_id);
+        DataPartHeader old_header;
+        readDataPartHeader(old_header, datapart_pos);
+        uint64_t old_reference = MINUS_ONE;
+        if (old_header.flags & FLAG_REFERENCE) {
+            old_reference = readUInt64At(datapart_pos + datapart_header_size);
         }
-        if (datapart_end_pos < file_size) {
-            assert(datapart_end_pos + DATAPART_FREESPACE_MIN_SIZE <= file_size);
-            assert(free_space_size >= DATAPART_FREESPACE_MIN_SIZE + datapart_size);
-            writeSeek(datapart_end_pos);
-            writeUInt63AndUInt1(free_space_size - datapart_size, DATAPART_TYPE_FREESPACE);
+        uint64_t old_hash = MINUS_ONE;
+        if (old_header.flags & FLAG_HASHED) {
+            old_hash = readContentHash(datapart_pos, old_header);
         }
-
-        assert(total_data_part_empty_space >= datapart_size);
-        total_data_part_empty_space -= datapart_size;
-    } else {
-        assert(datapart_pos == file_size);
-        file_size += datapart_size;
+        header.size = resizeDataPartInPlace(datapart_pos, old_header.size, getStoredSize(header));
+        if (header.size > 0) {
+            writeDataPart(datapart_pos, header, bytes, hash);
+            if (old_hash != MINUS_ONE) {
+                hashed_contents.erase(old_hash);
+            }
+            if (header.flags & FLAG_HASHED) {
+                hashed_contents[hash] = chunk_id;
+            }
+            if (old_reference != MINUS_ONE) {
+                releaseReference(old_reference);
+            }
+            writeHeader();
+            transaction.commit();
+            return;
+        }
+        // Old chunk needs to be cleared first. This is done before
+        // reserving, because removing might shrink the header area.
+        del(chunk_id);
     }
 
+    // If more chunk space needs to be allocated
+    reserveForNewChunks(chunk_id, 1);
+
+    // Find space for new data part
+    header.size = getDataPartSize(getStoredSize(header));
+    uint64_t datapart_pos = findFreeSpace(header.size);
+    useFreeSpace(datapart_pos, header.size);
+
     // Create new chunk
-    // Header part
-    writeSeek(HEADER_SIZE + chunk_id * HEADERPART_SIZE);
-    writeUInt64(datapart_pos);
-    // Data part
-    writeSeek(datapart_pos);
-    writeUInt63AndUInt1(DATAPART_DATA_MIN_SIZE + size, DATAPART_TYPE_DATA);
-    writeUInt64(chunk_id);
-    writeBytes(bytes, size);
+    writeHeaderPart(chunk_id, datapart_pos);
+    writeDataPart(datapart_pos, header, bytes, hash);
+    if (header.flags & FLAG_HASHED) {
+        hashed_contents[hash] = chunk_id;
+    }
 
     // Update header
     ++ chunks;
     writeHeader();
+
+    transaction.commit();
 }
 
-uint64_t Chunkfile::getChunkSize(uint64_t chunk_id)
+void Chunkfile::write(uint64_t chunk_id, uint64_t offset, uint8_t const* bytes, uint64_t size)
 {
-    uint64_t data_part_pos = getDataPartPosition(chunk_id);
-    readSeek(data_part_pos);
-    uint64_t data_part_size;
-    uint8_t data_part_type;
-    readUInt63AndUInt1(data_part_size, data_part_type);
-    if (data_part_type != DATAPART_TYPE_DATA) {
-        throw CorruptedFile();
+    Lock lock(this, true);
+    TransactionGuard transaction(this);
+
+    if (offset == MINUS_ONE) {
+        throw std::runtime_error("Offset is past the end of chunk!");
     }
-    return data_part_size - DATAPART_DATA_MIN_SIZE;
+    writeToChunk(chunk_id, offset, bytes, size);
+
+    transaction.commit();
 }
 
-void Chunkfile::get(uint8_t* result, uint64_t chunk_id)
+void Chunkfile::append(uint64_t chunk_id, uint8_t const* bytes, uint64_t size)
 {
-    uint64_t data_part_pos = getDataPartPosition(chunk_id);
-    readSeek(data_part_pos);
-    uint64_t data_part_size;
-    uint8_t data_part_type;
-    readUInt63AndUInt1(data_part_size, data_part_type);
-    if (data_part_type != DATAPART_TYPE_DATA) {
-        throw CorruptedFile();
+    Lock lock(this, true);
+    TransactionGuard transaction(this);
+
+    writeToChunk(chunk_id, MINUS_ONE, bytes, size);
+
+    transaction.commit();
+}
+
+uint64_t Chunkfile::allocateId()
+{
+    Lock lock(this, true);
+
+    uint64_t chunk_id = findFreeId();
+    set(chunk_id, NULL, 0);
+    return chunk_id;
+}
+
+uint64_t Chunkfile::add(uint8_t const* bytes, uint64_t size)
+{
+    Lock lock(this, true);
+
+    uint64_t chunk_id = findFreeId();
+    set(chunk_id, bytes, size);
+    return chunk_id;
+}
+
+uint64_t Chunkfile::getChunkSize(uint64_t chunk_id)
+{
+    Lock lock(this, false);
+
+    uint64_t contents_pos;
+    uint64_t contents_size;
+    uint8_t codec;
+    findChunkContents(contents_pos, contents_size, codec, chunk_id);
+    if (codec == CODEC_NONE) {
+        return contents_size;
     }
-    uint64_t check_chunk_id = readUInt64();
-    if (check_chunk_id != chunk_id) {
+    if (contents_size < 8) {
         throw CorruptedFile();
     }
-    readBytes(result, data_part_size - DATAPART_DATA_MIN_SIZE);
+    return readUInt64At(contents_pos);
 }
 
-void Chunkfile::del(uint64_t chunk_id)
+void Chunkfile::get(uint8_t* result, uint64_t chunk_id)
 {
-    uint64_t data_part_pos = getDataPartPosition(chunk_id);
-    // Convert data part to empty space
-    readSeek(data_part_pos);
-    uint64_t data_part_size;
-    uint8_t data_part_type;
-    readUInt63AndUInt1(data_part_size, data_part_type);
-    writeSeek(data_part_pos);
-    writeUInt63AndUInt1(data_part_size, DATAPART_TYPE_FREESPACE);
-// TODO: If there is free space after the data part, merge them.
-    // Remove header part
-    writeSeek(HEADER_SIZE + chunk_id * HEADERPART_SIZE);
-    writeUInt64(MINUS_ONE);
-    // Update counters
-    -- chunks;
-    total_data_part_empty_space += data_part_size;
-    // Check if it would be good time to do some optimizations
-    if (chunks * OPTIMIZE_THRESHOLD <= chunk_space_reserved) {
-        optimizeHeaderParts();
-    }
-    uint64_t data_area_begin = HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE;
-    uint64_t data_area_size = file_size - data_area_begin;
-    uint64_t actual_data_size = data_area_size - total_data_part_empty_space;
-    if (actual_data_size * OPTIMIZE_THRESHOLD <= data_area_size) {
-        optimizeDataParts();
+    Lock lock(this, false);
+
+    uint64_t contents_pos;
+    uint64_t contents_size;
+    uint8_t codec;
+    findChunkContents(contents_pos, contents_size, codec, chunk_id);
+    if (codec == CODEC_NONE) {
+        readBytesAt(contents_pos, result, contents_size);
+        return;
     }
+    Bytes contents;
+    readContents(contents, contents_pos, contents_size, codec);
+    std::copy(contents.begin(), contents.end(), result);
+}
 
-    writeHeader();
+void Chunkfile::get(Bytes& result, uint64_t chunk_id)
+{
+    Lock lock(this, false);
+
+    uint64_t contents_pos;
+    uint64_t contents_size;
+    uint8_t codec;
+    findChunkContents(contents_pos, contents_size, codec, chunk_id);
+    readContents(result, contents_pos, contents_size, codec);
 }
 
-void Chunkfile::verify()
+void Chunkfile::get(std::string& result, uint64_t chunk_id)
 {
-    // Verify some basic numbers
-    if (file_size != getFileSize()) {
-        throw CorruptedFile();
-    }
-    if (HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE > file_size) {
-        throw CorruptedFile();
-    }
-    // Verify header parts
-    uint64_t chunks_found = 0;
-    for (uint64_t chunk_id = 0; chunk_id < chunk_space_reserved; ++ chunk_id) {
-        readSeek(HEADER_SIZE + chunk_id * HEADERPART_SIZE);
-        uint64_t data_part_pos = readUInt64();
-        if (data_part_pos != MINUS_ONE) {
-            if (data_part_pos + DATAPART_FREESPACE_MIN_SIZE > file_size) {
-                throw CorruptedFile();
-            }
-            readSeek(data_part_pos);
-            uint64_t data_part_size;
-            uint8_t data_part_type;
-            readUInt63AndUInt1(data_part_size, data_part_type);
-            if (data_part_pos + data_part_size > file_size) {
-                throw CorruptedFile();
-            }
-            if (data_part_size < DATAPART_FREESPACE_MIN_SIZE) {
-                throw CorruptedFile();
-            }
-            if (data_part_type == DATAPART_TYPE_DATA) {
-                if (data_part_size < DATAPART_DATA_MIN_SIZE) {
-                    throw CorruptedFile();
-                }
-                uint64_t chunk_id2 = readUInt64();
-                if (chunk_id != chunk_id2) {
-                    throw CorruptedFile();
-                }
-            }
-            ++ chunks_found;
+    Lock lock(this, false);
+
+    uint64_t contents_pos;
+    uint64_t contents_size;
+    uint8_t codec;
+    findChunkContents(contents_pos, contents_size, codec, chunk_id);
+    if (codec == CODEC_NONE) {
+        result.resize(contents_size);
+        if (contents_size > 0) {
+            readBytesAt(contents_pos, (uint8_t*)&result[0], contents_size);
         }
+        return;
     }
-    if (chunks_found != chunks) {
-        throw CorruptedFile();
-    }
-    // Verify data parts
-    uint64_t empty_space_found = 0;
-    uint64_t data_part_pos = HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE;
-    while (data_part_pos != file_size) {
-        if (data_part_pos > file_size) {
-            throw CorruptedFile();
-        }
-        readSeek(data_part_pos);
-        uint64_t data_part_size;
-        uint8_t data_part_type;
-        readUInt63AndUInt1(data_part_size, data_part_type);
-        if (data_part_pos + data_part_size > file_size) {
-            throw CorruptedFile();
-        }
-        if (data_part_size < DATAPART_FREESPACE_MIN_SIZE) {
-            throw CorruptedFile();
-        }
-        if (data_part_type == DATAPART_TYPE_DATA) {
-            if (data_part_size < DATAPART_DATA_MIN_SIZE) {
-                throw CorruptedFile();
-            }
-            uint64_t chunk_id2 = readUInt64();
-            if (chunk_id2 >= chunk_space_reserved) {
-                throw CorruptedFile();
-            }
-        } else {
-            empty_space_found += data_part_size;
-        }
-        data_part_pos += data_part_size;
+    Bytes contents;
+    readContents(contents, contents_pos, contents_size, codec);
+    result.assign(contents.begin(), contents.end());
+}
+
+uint64_t Chunkfile::read(uint8_t* result, uint64_t chunk_id, uint64_t offset, uint64_t size)
+{
+    Lock lock(this, false);
+
+    uint64_t contents_pos;
+    uint64_t contents_size;
+    uint8_t codec;
+    findChunkContents(contents_pos, contents_size, codec, chunk_id);
+    if (codec != CODEC_NONE) {
+        Bytes contents;
+        readContents(contents, contents_pos, contents_size, codec);
+        offset = std::min<uint64_t>(offset, contents.size());
+        size = std::min<uint64_t>(size, contents.size() - offset);
+        std::copy(contents.begin() + offset, contents.begin() + offset + size, result);
+        return size;
     }
-    if (empty_space_found != total_data_part_empty_space) {
-        throw CorruptedFile();
+    offset = std::min(offset, contents_size);
+    size = std::min(size, contents_size - offset);
+    if (size > 0) {
+        readBytesAt(contents_pos + offset, result, size);
     }
+    return size;
 }
 
-void Chunkfile::optimize()
+void Chunkfile::read(Bytes& result, uint64_t chunk_id, uint64_t offset, uint64_t size)
 {
-    optimizeHeaderParts();
-    optimizeDataParts();
+    Lock lock(this, false);
+
+    uint64_t contents_pos;
+    uint64_t contents_size;
+    uint8_t codec;
+    findChunkContents(contents_pos, contents_size, codec, chunk_id);
+    if (codec != CODEC_NONE) {
+        Bytes contents;
+        readContents(contents, contents_pos, contents_size, codec);
+        offset = std::min<uint64_t>(offset, contents.size());
+        size = std::min<uint64_t>(size, contents.size() - offset);
+        result.assign(contents.begin() + offset, contents.begin() + offset + size);
+        return;
+    }
+    offset = std::min(offset, contents_size);
+    size = std::min(size, contents_size - offset);
+    result.resize(size);
+    if (size > 0) {
+        readBytesAt(contents_pos + offset, &result[0], size);
+    }
 }
 
-void Chunkfile::writeHeader()
+Chunkfile::Reader Chunkfile::getReader(uint64_t chunk_id, uint64_t buffer_size)
 {
-    file_size = std::max<uint64_t>(file_size, HEADER_SIZE);
-    assert(chunks <= chunk_space_reserved);
-    assert(HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE + total_data_part_empty_space <= file_size);
-    writeSeek(HEADER_MAGIC_AND_VERSION_SIZE);
-    writeUInt64(chunks);
-    writeUInt64(chunk_space_reserved);
-    writeUInt64(total_data_part_empty_space);
+    return Reader(this, chunk_id, buffer_size);
 }
 
-uint64_t Chunkfile::findFreeSpace(uint64_t size, uint64_t min_limit)
+Chunkfile::Reader::Reader(Chunkfile* chunkfile, uint64_t chunk_id, uint64_t buffer_size) :
+    chunkfile(chunkfile),
+    chunk_id(chunk_id),
+    size(0),
+    pos(0),
+    buffer_pos(0),
+    buffer_size(std::max<uint64_t>(buffer_size, 1)),
+    compressed(false)
 {
-    // If minimum limit is after the file size, then create
-    // some extra free space at the end of the file. This
-    // way it is possible to return the end of the file.
-    if (min_limit != MINUS_ONE && min_limit > file_size) {
-        // Calculate how much extra free space is needed. It needs
-        // to be at least the length of minimum sized datapart.
-        uint64_t new_free_space_size = std::max<uint64_t>(min_limit - file_size, DATAPART_FREESPACE_MIN_SIZE);
-
-        // Create new datapart of free space
-        writeSeek(file_size);
-        writeUInt63AndUInt1(new_free_space_size, DATAPART_TYPE_FREESPACE);
-        writeUnexpected(new_free_space_size - DATAPART_FREESPACE_MIN_SIZE);
-
-        // Update counters
-        file_size += new_free_space_size;
-        total_data_part_empty_space += new_free_space_size;
-        writeHeader();
+    Lock lock(chunkfile, false);
 
-        return file_size;
+    uint64_t contents_pos;
+    uint64_t contents_size;
+    uint8_t codec;
+    chunkfile->findChunkContents(contents_pos, contents_size, codec, chunk_id);
+    if (codec != CODEC_NONE) {
+        chunkfile->readContents(buffer, contents_pos, contents_size, codec);
+        compressed = true;
+        size = buffer.size();
+    } else {
+        size = contents_size;
     }
+}
 
-    // For now, just return the end of the file.
-(void)size;
-// TODO: In the future, try to do some optimization if there is lots of free space.
-    return file_size;
+uint64_t Chunkfile::Reader::read(uint8_t* result, uint64_t size)
+{
+    uint64_t total_read = 0;
+    while (size > 0 && pos < this->size) {
+        // If buffer does not have the current position
+        if (pos < buffer_pos || pos >= buffer_pos + buffer.size()) {
+            assert(!compressed);
+            // Big reads go directly to the result
+            if (size >= buffer_size) {
+                uint64_t read_size = chunkfile->read(result, chunk_id, pos, size);
+                if (read_size == 0) {
+                    break;
+                }
+                total_read += read_size;
+                pos += read_size;
+                break;
+            }
+            buffer.resize(buffer_size);
+            buffer.resize(chunkfile->read(buffer.data(), chunk_id, pos, buffer_size));
+            buffer_pos = pos;
+            if (buffer.empty()) {
+                break;
+            }
+        }
+        uint64_t copy_size = std::min(size, buffer_pos + buffer.size() - pos);
+        std::copy(buffer.begin() + (pos - buffer_pos), buffer.begin() + (pos - buffer_pos + copy_size), result);
+        result += copy_size;
+        size -= copy_size;
+        total_read += copy_size;
+        pos += copy_size;
+    }
+    return total_read;
 }
 
-uint64_t Chunkfile::getDataPartPosition(uint64_t chunk_id)
+Chunkfile::View Chunkfile::getView(uint64_t chunk_id)
 {
-    if (chunk_id >= chunk_space_reserved) {
+    // If writes are buffered, they need to be applied
+    Lock lock(this, options.write_ahead_log || options.write_back_size > 0);
+
+    if (!hasSparseIds() && chunk_id >= chunk_space_reserved) {
         throw ChunkDoesNotExist();
     }
-    readSeek(HEADER_SIZE + chunk_id * HEADERPART_SIZE);
-    uint64_t data_part_pos = readUInt64();
+    uint8_t const* map = mapFile();
+
+    // Find data part
+    uint64_t data_part_pos;
+    if (options.cache_header_parts || hasSparseIds()) {
+        data_part_pos = readHeaderPart(chunk_id);
+    } else {
+        data_part_pos = decodeUInt64(map + HEADER_SIZE + chunk_id * HEADERPART_SIZE);
+    }
     if (data_part_pos == MINUS_ONE) {
         throw ChunkDoesNotExist();
     }
-    return data_part_pos;
-}
-
-void Chunkfile::moveDataPart(uint64_t datapart_pos, uint64_t new_datapart_pos)
-{
-    // Read datapart information
-    readSeek(datapart_pos);
-    uint64_t datapart_size;
-    uint8_t datapart_type;
-    readUInt63AndUInt1(datapart_size, datapart_type);
-    if (datapart_size < DATAPART_DATA_MIN_SIZE) {
-        throw CorruptedFile();
-    }
-    if (datapart_type != DATAPART_TYPE_DATA) {
+    if (data_part_pos + datapart_header_size > file_size) {
         throw CorruptedFile();
     }
-    uint64_t chunk_id = readUInt64();
-    if (chunk_id >= chunk_space_reserved) {
+
+    // Check data part
+    DataPartHeader header;
+    decodeDataPartHeader(header, map + data_part_pos);
+    if (header.chunk_id != chunk_id || data_part_pos + header.size > file_size) {
         throw CorruptedFile();
     }
-    uint64_t datapart_data_size = datapart_size - DATAPART_DATA_MIN_SIZE;
-    uint8_t* datapart_data = new uint8_t[datapart_data_size];
-    readBytes(datapart_data, datapart_data_size);
-
-    try {
-        // If target is end of file
-        if (new_datapart_pos == file_size) {
-            // Copy to new position
-            writeSeek(new_datapart_pos);
-            writeUInt63AndUInt1(datapart_size, DATAPART_TYPE_DATA);
-            writeUInt64(chunk_id);
-            writeBytes(datapart_data, datapart_data_size);
-            file_size += datapart_size;
-            // Convert old position with free space
-            writeSeek(datapart_pos);
-            writeUInt63AndUInt1(datapart_size, DATAPART_TYPE_FREESPACE);
-// TODO: If next datapart is also empty, it is good idea to combine them!
-            total_data_part_empty_space += datapart_size;
-        } else {
-// TODO: Code this!
-throw std::runtime_error("Not implemented yet!");
+    if (header.flags & FLAG_REFERENCE) {
+        uint64_t hash = decodeUInt64(map + data_part_pos + datapart_header_size);
+        std::map<uint64_t, SharedContents>::const_iterator shared_contents_find = shared_contents.find(hash);
+        if (shared_contents_find == shared_contents.end()) {
+            throw CorruptedFile();
+        }
+        data_part_pos = shared_contents_find->second.pos;
+        if (data_part_pos + datapart_header_size > file_size) {
+            throw CorruptedFile();
+        }
+        decodeDataPartHeader(header, map + data_part_pos);
+        if (!(header.flags & FLAG_SHARED) || header.chunk_id != hash || data_part_pos + header.size > file_size) {
+            throw CorruptedFile();
         }
     }
-    catch ( ... ) {
-        delete[] datapart_data;
-        throw;
+    if (header.codec != CODEC_NONE) {
+        throw std::runtime_error("Compressed chunks can not be viewed!");
     }
-    delete[] datapart_data;
-
-    // Update chunk
-    writeSeek(HEADER_SIZE + chunk_id * HEADERPART_SIZE);
-    writeUInt64(new_datapart_pos);
 
-    writeHeader();
+    View view;
+    view.data = map + data_part_pos + datapart_header_size;
+    view.size = header.contents_size;
+    return view;
 }
 
-void Chunkfile::optimizeHeaderParts()
+void Chunkfile::del(uint64_t chunk_id)
 {
-    // Calculate how many empty chunks are at the end of header area
-    uint64_t empty_chunks_at_end = 0;
-    while (empty_chunks_at_end < chunk_space_reserved) {
-        uint64_t chunk_id = chunk_space_reserved - 1 - empty_chunks_at_end;
-        readSeek(HEADER_SIZE + chunk_id * HEADERPART_SIZE);
-        uint64_t datapart_pos = readUInt64();
-        if (datapart_pos == MINUS_ONE) {
-            ++ empty_chunks_at_end;
+    Lock lock(this, true);
+    TransactionGuard transaction(this);
+
+    uint64_t data_part_pos = getDataPartPosition(chunk_id);
+    freeDataPart(data_part_pos);
+    // Remove header part
+    writeHeaderPart(chunk_id, MINUS_ONE);
+    // Update counters
+    -- chunks;
+    optimizeIfNeeded();
+
+    writeHeader();
+
+    transaction.commit();
+}
+
+Chunkfile::Iterator Chunkfile::getIterator(uint64_t buffer_size)
+{
+    return Iterator(this, buffer_size);
+}
+
+Chunkfile::Iterator::Iterator(Chunkfile* chunkfile, uint64_t buffer_size) :
+    chunkfile(chunkfile),
+    pos(0),
+    buffer_pos(0),
+    buffer_size(std::max<uint64_t>(buffer_size, DATAPART_HEADER_SIZE_V1))
+{
+    Lock lock(chunkfile, false);
+
+    pos = HEADER_SIZE + chunkfile->chunk_space_reserved * HEADERPART_SIZE;
+}
+
+bool Chunkfile::Iterator::next(uint64_t& chunk_id, Bytes& contents)
+{
+    Lock lock(chunkfile, false);
+
+    uint64_t file_size = chunkfile->file_size;
+    uint64_t datapart_header_size = chunkfile->datapart_header_size;
+    while (pos < file_size) {
+        // Skip free space
+        fillBuffer(pos, DATAPART_FREESPACE_MIN_SIZE);
+        uint64_t size_and_type = decodeUInt64(&buffer[pos - buffer_pos]);
+        uint64_t datapart_size = size_and_type & 0x7fffffffffffffff;
+        if (datapart_size < DATAPART_FREESPACE_MIN_SIZE || pos + datapart_size > file_size) {
+            throw CorruptedFile();
+        }
+        if ((size_and_type >> 63) == DATAPART_TYPE_FREESPACE) {
+            pos += datapart_size;
+            continue;
+        }
+
+        DataPartHeader header;
+        if (datapart_size < datapart_header_size) {
+            throw CorruptedFile();
+        }
+        fillBuffer(pos, datapart_header_size);
+        chunkfile->decodeDataPartHeader(header, &buffer[pos - buffer_pos]);
+        if (header.size != datapart_size) {
+            throw CorruptedFile();
+        }
+        // Shared contents are returned with the chunks that refer to them
+        if (header.flags & FLAG_SHARED) {
+            pos += datapart_size;
+            continue;
+        }
+
+        // Small contents are read through the buffer
+        uint64_t contents_pos = pos + datapart_header_size;
+        Bytes stored;
+        if (datapart_header_size + header.contents_size <= buffer_size) {
+            fillBuffer(pos, datapart_header_size + header.contents_size);
+            stored.assign(buffer.begin() + (contents_pos - buffer_pos), buffer.begin() + (contents_pos - buffer_pos + header.contents_size));
         } else {
-            break;
+            stored.resize(header.contents_size);
+            chunkfile->readBytesAt(contents_pos, &stored[0], stored.size());
+        }
+        if (header.flags & FLAG_REFERENCE) {
+            uint64_t shared_pos;
+            uint64_t shared_size;
+            uint8_t shared_codec;
+            chunkfile->findSharedContents(shared_pos, shared_size, shared_codec, decodeUInt64(stored.data()));
+            chunkfile->readContents(contents, shared_pos, shared_size, shared_codec);
+        } else if (header.codec == CODEC_NONE) {
+            contents.swap(stored);
+        } else {
+            decompressContents(contents, stored.data(), stored.size(), header.codec);
         }
+        chunk_id = header.chunk_id;
+        pos += datapart_size;
+        return true;
     }
-    // If empty chunks were found, then shrink chunk reservation
-    if (empty_chunks_at_end) {
-        chunk_space_reserved -= empty_chunks_at_end;
-        uint64_t data_area_move = empty_chunks_at_end * HEADERPART_SIZE;
-        uint64_t new_data_area_begin = HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE;
-        writeSeek(new_data_area_begin);
-        writeUInt63AndUInt1(data_area_move, DATAPART_TYPE_FREESPACE);
-        total_data_part_empty_space += data_area_move;
+    return false;
+}
+
+void Chunkfile::Iterator::fillBuffer(uint64_t pos, uint64_t size)
+{
+    if (pos >= buffer_pos && pos + size <= buffer_pos + buffer.size()) {
+        return;
+    }
+    assert(pos + size <= chunkfile->file_size);
+    buffer_pos = pos;
+    buffer.resize(std::min(std::max(size, buffer_size), chunkfile->file_size - pos));
+    chunkfile->readBytesAt(pos, &buffer[0], buffer.size());
+}
+
+void Chunkfile::getMany(std::vector<Bytes>& results, std::vector<uint64_t> const& chunk_ids)
+{
+    Lock lock(this, false);
+
+    // Find all data parts
+    std::vector<uint64_t> data_part_positions;
+    readHeaderParts(data_part_positions, chunk_ids);
+    std::vector<std::pair<uint64_t, size_t> > reads;
+    reads.reserve(chunk_ids.size());
+    for (size_t i = 0; i < chunk_ids.size(); ++ i) {
+        if (data_part_positions[i] == MINUS_ONE) {
+            throw ChunkDoesNotExist();
+        }
+        reads.push_back(std::make_pair(data_part_positions[i], i));
+    }
+    std::sort(reads.begin(), reads.end());
+
+    // Read data parts in the order they are in the file. Data parts
+    // that are near each others are read with a single read.
+    results.resize(chunk_ids.size());
+    Bytes block;
+    uint64_t block_pos = 0;
+    for (size_t i = 0; i < reads.size(); ++ i) {
+        uint64_t data_part_pos = reads[i].first;
+        uint64_t chunk_id = chunk_ids[reads[i].second];
+
+        // If data part header is not in the current block, then read new
+        // block that contains as many of the following data parts as
+        // possible. Sizes are not known yet, so minimum sizes are used.
+        if (data_part_pos < block_pos || data_part_pos + datapart_header_size > block_pos + block.size()) {
+            uint64_t block_end = data_part_pos + datapart_header_size;
+            for (size_t j = i + 1; j < reads.size(); ++ j) {
+                uint64_t next_end = reads[j].first + datapart_header_size;
+                if (reads[j].first > block_end + BATCH_IO_MAX_GAP || next_end - data_part_pos > BATCH_IO_MAX_SIZE) {
+                    break;
+                }
+                block_end = std::max(block_end, next_end);
+            }
+            block_end = std::min(std::max(block_end, data_part_pos + BATCH_IO_MAX_GAP), file_size);
+            block_pos = data_part_pos;
+            block.resize(block_end - block_pos);
+            readBytesAt(block_pos, &block[0], block.size());
+            if (data_part_pos + datapart_header_size > block_end) {
+                throw CorruptedFile();
+            }
+        }
+
+        // Check data part
+        DataPartHeader header;
+        decodeDataPartHeader(header, &block[data_part_pos - block_pos]);
+        if (header.chunk_id != chunk_id) {
+            throw CorruptedFile();
+        }
+
+        // Get contents. If they do not fit in the block, then read the rest.
+        Bytes& result = results[reads[i].second];
+        uint64_t result_size = header.contents_size;
+        uint64_t result_pos = data_part_pos + datapart_header_size;
+        uint64_t size_in_block = std::min(result_size, block_pos + block.size() - result_pos);
+        result.resize(result_size);
+        std::copy(block.begin() + (result_pos - block_pos), block.begin() + (result_pos - block_pos + size_in_block), result.begin());
+        if (size_in_block < result_size) {
+            readBytesAt(result_pos + size_in_block, &result[size_in_block], result_size - size_in_block);
+        }
+        if (header.flags & FLAG_REFERENCE) {
+            uint64_t shared_pos;
+            uint64_t shared_size;
+            uint8_t shared_codec;
+            findSharedContents(shared_pos, shared_size, shared_codec, decodeUInt64(result.data()));
+            readContents(result, shared_pos, shared_size, shared_codec);
+        } else if (header.codec != CODEC_NONE) {
+            Bytes decompressed;
+            decompressContents(decompressed, result.data(), result.size(), header.codec);
+            result.swap(decompressed);
+        }
+    }
+}
+
+void Chunkfile::setMany(std::vector<uint64_t> const& chunk_ids, std::vector<Bytes> const& values)
+{
+    std::vector<Bytes const*> value_pointers;
+    value_pointers.reserve(values.size());
+    for (Bytes const& value : values) {
+        value_pointers.push_back(&value);
+    }
+    setMany(chunk_ids, value_pointers);
+}
+
+void Chunkfile::setMany(std::vector<uint64_t> const& chunk_ids, std::vector<Bytes const*> const& values)
+{
+    if (chunk_ids.size() != values.size()) {
+        throw std::runtime_error("Number of chunk IDs and values differ!");
+    }
+    if (chunk_ids.empty()) {
+        return;
+    }
+    if (std::find(chunk_ids.begin(), chunk_ids.end(), MINUS_ONE) != chunk_ids.end()) {
+        throw std::runtime_error("Chunk ID 2^64-1 is reserved!");
+    }
+
+    Lock lock(this, true);
+    TransactionGuard transaction(this);
+
+    // If same chunk is given multiple times, then only the last one is used
+    std::map<uint64_t, size_t> values_by_chunk_id;
+    for (size_t i = 0; i < chunk_ids.size(); ++ i) {
+        values_by_chunk_id[chunk_ids[i]] = i;
+    }
+
+    // Shared contents need to be looked up one chunk at a time
+    if (hasDeduplication()) {
+        for (std::map<uint64_t, size_t>::const_iterator it = values_by_chunk_id.begin(); it != values_by_chunk_id.end(); ++ it) {
+            set(it->first, *values[it->second]);
+        }
+        transaction.commit();
+        return;
+    }
+
+    // Remove old chunks
+    std::vector<std::pair<uint64_t, uint64_t> > header_parts_to_write;
+    for (std::map<uint64_t, size_t>::const_iterator it = values_by_chunk_id.begin(); it != values_by_chunk_id.end(); ++ it) {
+        if (exists(it->first)) {
+            freeDataPart(readHeaderPart(it->first));
+            -- chunks;
+        }
+    }
+
+    // If more chunk space needs to be allocated
+    reserveForNewChunks(values_by_chunk_id.rbegin()->first, values_by_chunk_id.size());
+
+    // Compress values, if they get smaller
+    std::vector<Bytes> compressed_values;
+    std::vector<Bytes const*> stored_values(values.size());
+    if (options.compression == Options::COMPRESSION_LZ4 && version > 0) {
+        compressed_values.resize(values.size());
+    }
+    for (std::map<uint64_t, size_t>::const_iterator it = values_by_chunk_id.begin(); it != values_by_chunk_id.end(); ++ it) {
+        Bytes const& value = *values[it->second];
+        stored_values[it->second] = &value;
+        stat_bytes_set += value.size();
+        if (!compressed_values.empty() && compressContents(compressed_values[it->second], value.data(), value.size())) {
+            stored_values[it->second] = &compressed_values[it->second];
+        }
+    }
+
+    // Find space for all new data parts
+    uint16_t flags = getNewDataPartFlags();
+    uint64_t checksum_size = flags & FLAG_CHECKSUM ? CHECKSUM_SIZE : 0;
+    std::vector<std::pair<uint64_t, uint64_t> > data_parts_to_write;
+    for (std::map<uint64_t, size_t>::const_iterator it = values_by_chunk_id.begin(); it != values_by_chunk_id.end(); ++ it) {
+        if (version > 0 && stored_values[it->second]->size() > MAX_CONTENTS_SIZE) {
+            throw std::runtime_error("Chunk is too big!");
+        }
+        uint64_t datapart_size = getDataPartSize(stored_values[it->second]->size() + checksum_size);
+        uint64_t datapart_pos = findFreeSpace(datapart_size);
+        useFreeSpace(datapart_pos, datapart_size);
+        header_parts_to_write.push_back(std::make_pair(it->first, datapart_pos));
+        data_parts_to_write.push_back(std::make_pair(datapart_pos, it->first));
+    }
+    std::sort(data_parts_to_write.begin(), data_parts_to_write.end());
+
+    // Write data parts in the order they are in the file. Data parts
+    // that are next to each others are written at once. Unused space
+    // at the end of data parts is not written.
+    Bytes block;
+    uint64_t block_pos = 0;
+    DataPartHeader header;
+    header.flags = flags;
+    for (size_t i = 0; i < data_parts_to_write.size(); ++ i) {
+        uint64_t datapart_pos = data_parts_to_write[i].first;
+        uint64_t chunk_id = data_parts_to_write[i].second;
+        size_t value_index = values_by_chunk_id[chunk_id];
+        Bytes const& value = *stored_values[value_index];
+        if (!block.empty() && (datapart_pos != block_pos + block.size() || block.size() + value.size() + checksum_size > BATCH_IO_MAX_SIZE)) {
+            writeSeek(block_pos);
+            writeBytes(&block[0], block.size());
+            block.clear();
+        }
+        if (block.empty()) {
+            block_pos = datapart_pos;
+        }
+        header.size = getDataPartSize(value.size() + checksum_size);
+        header.chunk_id = chunk_id;
+        header.contents_size = value.size();
+        header.codec = &value == values[value_index] ? CODEC_NONE : CODEC_LZ4;
+        block.resize(block.size() + datapart_header_size);
+        encodeDataPartHeader(&block[block.size() - datapart_header_size], header);
+        block.insert(block.end(), value.begin(), value.end());
+        if (checksum_size > 0) {
+            block.resize(block.size() + CHECKSUM_SIZE);
+            encodeUInt32(&block[block.size() - CHECKSUM_SIZE], calculateCrc32c(value.data(), value.size()));
+        }
+    }
+    writeSeek(block_pos);
+    writeBytes(&block[0], block.size());
+    // If the last data part has unused space at the end of file
+    if (block_pos + block.size() < file_size && data_parts_to_write.back().first + header.size == file_size) {
+        extendFile(file_size);
+    }
+
+    // Header parts and header
+    writeHeaderParts(header_parts_to_write);
+    chunks += header_parts_to_write.size();
+    writeHeader();
+
+    transaction.commit();
+}
+
+void Chunkfile::delMany(std::vector<uint64_t> const& chunk_ids)
+{
+    Lock lock(this, true);
+    TransactionGuard transaction(this);
+
+    // Find all data parts before modifying anything
+    std::vector<uint64_t> data_part_positions;
+    readHeaderParts(data_part_positions, chunk_ids);
+    std::map<uint64_t, uint64_t> data_parts_to_free;
+    for (size_t i = 0; i < chunk_ids.size(); ++ i) {
+        if (data_part_positions[i] == MINUS_ONE) {
+            throw ChunkDoesNotExist();
+        }
+        data_parts_to_free[data_part_positions[i]] = chunk_ids[i];
+    }
+
+    // Free data parts in the order they are in the file
+    std::vector<std::pair<uint64_t, uint64_t> > header_parts_to_write;
+    for (std::map<uint64_t, uint64_t>::const_iterator it = data_parts_to_free.begin(); it != data_parts_to_free.end(); ++ it) {
+        freeDataPart(it->first);
+        header_parts_to_write.push_back(std::make_pair(it->second, MINUS_ONE));
+    }
+    std::sort(header_parts_to_write.begin(), header_parts_to_write.end());
+    writeHeaderParts(header_parts_to_write);
+    chunks -= header_parts_to_write.size();
+    optimizeIfNeeded();
+
+    writeHeader();
+
+    transaction.commit();
+}
+
+std::future<Chunkfile::Bytes> Chunkfile::getAsync(uint64_t chunk_id)
+{
+    std::shared_ptr<std::packaged_task<Bytes()> > task(new std::packaged_task<Bytes()>([this, chunk_id]() {
+        return getBytes(chunk_id);
+    }));
+    std::future<Bytes> result = task->get_future();
+    addAsyncOperation(chunk_id, [task]() { (*task)(); });
+    return result;
+}
+
+std::future<void> Chunkfile::setAsync(uint64_t chunk_id, Bytes bytes)
+{
+    std::shared_ptr<Bytes> shared_bytes(new Bytes());
+    shared_bytes->swap(bytes);
+    std::shared_ptr<std::packaged_task<void()> > task(new std::packaged_task<void()>([this, chunk_id, shared_bytes]() {
+        set(chunk_id, *shared_bytes);
+    }));
+    std::future<void> result = task->get_future();
+    addAsyncOperation(chunk_id, [task]() { (*task)(); });
+    return result;
+}
+
+std::future<void> Chunkfile::delAsync(uint64_t chunk_id)
+{
+    std::shared_ptr<std::packaged_task<void()> > task(new std::packaged_task<void()>([this, chunk_id]() {
+        del(chunk_id);
+    }));
+    std::future<void> result = task->get_future();
+    addAsyncOperation(chunk_id, [task]() { (*task)(); });
+    return result;
+}
+
+void Chunkfile::verify(bool check_contents, unsigned threads)
+{
+    Lock lock(this, true);
+
+    // Verify some basic numbers. The size of the actual file
+    // can only be checked if there are no pending writes.
+    if (options.write_ahead_log && transaction_depth == 0) {
+        sync();
+    }
+    bool writes_applied = pending_writes.empty() && pending_truncate == MINUS_ONE && transaction_writes.empty() && transaction_truncate == MINUS_ONE;
+    if (writes_applied && file_size != getFileSize()) {
+        throw CorruptedFile();
+    }
+    if (HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE > file_size) {
+        throw CorruptedFile();
+    }
+    if (options.cache_header_parts && header_parts.size() != chunk_space_reserved) {
+        throw CorruptedFile();
+    }
+    // Verify header parts. They are read in big blocks, and
+    // the data parts they point to are collected.
+    std::vector<std::pair<uint64_t, uint64_t> > data_parts;
+    data_parts.reserve(chunks + shared_contents.size() + free_spaces.size());
+    // With sparse IDs, the chunks and their slots are collected too
+    if (hasSparseIds() && chunk_space_reserved % HEADERPARTS_PER_SLOT != 0) {
+        throw CorruptedFile();
+    }
+    std::vector<bool> occupied_slots(hasSparseIds() ? getSlotCount() : 0);
+    std::vector<std::pair<uint64_t, uint64_t> > slot_chunk_ids;
+    Bytes block;
+    for (uint64_t block_begin = 0; block_begin < chunk_space_reserved; block_begin += VERIFY_BLOCK_SIZE / HEADERPART_SIZE) {
+        uint64_t block_end = std::min(chunk_space_reserved, block_begin + VERIFY_BLOCK_SIZE / HEADERPART_SIZE);
+        block.resize((block_end - block_begin) * HEADERPART_SIZE);
+        readBytesAt(HEADER_SIZE + block_begin * HEADERPART_SIZE, &block[0], block.size());
+        if (hasSparseIds()) {
+            for (uint64_t index = block_begin; index < block_end; index += HEADERPARTS_PER_SLOT) {
+                uint64_t chunk_id = decodeUInt64(&block[(index - block_begin) * HEADERPART_SIZE]);
+                uint64_t data_part_pos = decodeUInt64(&block[(index + 1 - block_begin) * HEADERPART_SIZE]);
+                if (options.cache_header_parts && (header_parts[index] != chunk_id || header_parts[index + 1] != data_part_pos)) {
+                    throw CorruptedFile();
+                }
+                if (data_part_pos == MINUS_ONE) {
+                    if (chunk_id != MINUS_ONE) {
+                        throw CorruptedFile();
+                    }
+                    continue;
+                }
+                occupied_slots[index / HEADERPARTS_PER_SLOT] = true;
+                slot_chunk_ids.push_back(std::make_pair(chunk_id, index / HEADERPARTS_PER_SLOT));
+                data_parts.push_back(std::make_pair(data_part_pos, chunk_id));
+            }
+            continue;
+        }
+        for (uint64_t chunk_id = block_begin; chunk_id < block_end; ++ chunk_id) {
+            uint64_t data_part_pos = decodeUInt64(&block[(chunk_id - block_begin) * HEADERPART_SIZE]);
+            if (options.cache_header_parts && header_parts[chunk_id] != data_part_pos) {
+                throw CorruptedFile();
+            }
+            if (free_ids_loaded && (free_ids.count(chunk_id) > 0) != (data_part_pos == MINUS_ONE)) {
+                throw CorruptedFile();
+            }
+            if (data_part_pos != MINUS_ONE) {
+                data_parts.push_back(std::make_pair(data_part_pos, chunk_id));
+            }
+        }
+    }
+    block = Bytes();
+    if (data_parts.size() != chunks) {
+        throw CorruptedFile();
+    }
+    // Every chunk must be found by probing from its home
+    // slot, and the same chunk must not be there twice.
+    std::sort(slot_chunk_ids.begin(), slot_chunk_ids.end());
+    for (size_t i = 0; i < slot_chunk_ids.size(); ++ i) {
+        if (i > 0 && slot_chunk_ids[i - 1].first == slot_chunk_ids[i].first) {
+            throw CorruptedFile();
+        }
+        uint64_t slots = getSlotCount();
+        for (uint64_t slot = getHomeSlot(slot_chunk_ids[i].first, slots); slot != slot_chunk_ids[i].second; slot = (slot + 1) % slots) {
+            if (!occupied_slots[slot]) {
+                throw CorruptedFile();
+            }
+        }
+    }
+    if (hasSparseIds() && chunks * 2 > getSlotCount()) {
+        throw CorruptedFile();
+    }
+    if (free_ids_loaded && free_ids.size() != chunk_space_reserved - chunks) {
+        throw CorruptedFile();
+    }
+    // Shared contents have no header parts
+    for (std::map<uint64_t, SharedContents>::const_iterator it = shared_contents.begin(); it != shared_contents.end(); ++ it) {
+        data_parts.push_back(std::make_pair(it->second.pos, it->first));
+    }
+
+    // Together with free spaces, data parts should fill the data area
+    // without gaps or overlapping. Their headers are checked later.
+    uint64_t empty_space_found = 0;
+    for (std::map<uint64_t, uint64_t>::const_iterator it = free_spaces.begin(); it != free_spaces.end(); ++ it) {
+        data_parts.push_back(std::make_pair(it->first, MINUS_ONE));
+        empty_space_found += it->second;
+    }
+    if (empty_space_found != total_data_part_empty_space) {
+        throw CorruptedFile();
+    }
+    if (free_spaces.size() != free_spaces_by_size.size()) {
+        throw CorruptedFile();
+    }
+    std::sort(data_parts.begin(), data_parts.end());
+    uint64_t data_part_pos = HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE;
+    for (size_t i = 0; i < data_parts.size(); ++ i) {
+        if (data_parts[i].first != data_part_pos) {
+            throw CorruptedFile();
+        }
+        uint64_t data_part_end = i + 1 < data_parts.size() ? data_parts[i + 1].first : file_size;
+        if (data_part_end < data_part_pos + DATAPART_FREESPACE_MIN_SIZE) {
+            throw CorruptedFile();
+        }
+        if (data_parts[i].second == MINUS_ONE && free_spaces[data_part_pos] != data_part_end - data_part_pos) {
+            throw CorruptedFile();
+        }
+        data_part_pos = data_part_end;
+    }
+    if (data_part_pos != file_size) {
+        throw CorruptedFile();
+    }
+
+    // Split data area to ranges for threads
+    uint64_t data_area_begin = HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE;
+    if (threads == 0) {
+        threads = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+    }
+    uint64_t ranges = std::min<uint64_t>(threads, (file_size - data_area_begin) / VERIFY_BLOCK_SIZE + 1);
+    std::vector<size_t> range_begins;
+    for (size_t i = 0; i < data_parts.size(); ++ i) {
+        if (data_parts[i].first - data_area_begin >= range_begins.size() * (file_size - data_area_begin) / ranges) {
+            range_begins.push_back(i);
+        }
+    }
+    range_begins.push_back(data_parts.size());
+
+    // The first range is verified by this thread
+    std::vector<std::thread> range_threads;
+    std::vector<std::exception_ptr> errors(range_begins.size());
+    std::vector<std::map<uint64_t, uint64_t> > references(range_begins.size());
+    std::vector<std::map<uint64_t, uint64_t> > hashes(range_begins.size());
+    for (size_t range = 1; range + 1 < range_begins.size(); ++ range) {
+        range_threads.push_back(std::thread([this, &data_parts, &range_begins, &errors, &references, &hashes, range, check_contents]() {
+            try {
+                verifyDataParts(data_parts, range_begins[range], range_begins[range + 1], check_contents, references[range], hashes[range]);
+            } catch (...) {
+                errors[range] = std::current_exception();
+            }
+        }));
+    }
+    try {
+        if (range_begins.size() > 1) {
+            verifyDataParts(data_parts, range_begins[0], range_begins[1], check_contents, references[0], hashes[0]);
+        }
+    } catch (...) {
+        errors[0] = std::current_exception();
+    }
+    for (std::thread& thread : range_threads) {
+        thread.join();
+    }
+    for (size_t range = 0; range < errors.size(); ++ range) {
+        if (errors[range]) {
+            std::rethrow_exception(errors[range]);
+        }
+    }
+
+    // References to shared contents must match their counts
+    std::map<uint64_t, uint64_t> total_references;
+    for (size_t range = 0; range < references.size(); ++ range) {
+        for (std::map<uint64_t, uint64_t>::const_iterator it = references[range].begin(); it != references[range].end(); ++ it) {
+            total_references[it->first] += it->second;
+        }
+    }
+    for (std::map<uint64_t, uint64_t>::const_iterator it = total_references.begin(); it != total_references.end(); ++ it) {
+        std::map<uint64_t, SharedContents>::const_iterator shared_contents_find = shared_contents.find(it->first);
+        if (shared_contents_find == shared_contents.end() || shared_contents_find->second.references != it->second) {
+            throw CorruptedFile();
+        }
+    }
+    for (std::map<uint64_t, SharedContents>::const_iterator it = shared_contents.begin(); it != shared_contents.end(); ++ it) {
+        if (it->second.references > 0 && total_references.count(it->first) == 0) {
+            throw CorruptedFile();
+        }
+    }
+
+    // Every hashed chunk must be found by its hash
+    uint64_t total_hashes = 0;
+    for (size_t range = 0; range < hashes.size(); ++ range) {
+        for (std::map<uint64_t, uint64_t>::const_iterator it = hashes[range].begin(); it != hashes[range].end(); ++ it) {
+            std::map<uint64_t, uint64_t>::const_iterator hashed_contents_find = hashed_contents.find(it->first);
+            if (hashed_contents_find == hashed_contents.end() || hashed_contents_find->second != it->second) {
+                throw CorruptedFile();
+            }
+        }
+        total_hashes += hashes[range].size();
+    }
+    if (total_hashes != hashed_contents.size()) {
+        throw CorruptedFile();
+    }
+}
+
+void Chunkfile::verifyDataParts(std::vector<std::pair<uint64_t, uint64_t> > const& data_parts, size_t begin, size_t end, bool check_contents, std::map<uint64_t, uint64_t>& references, std::map<uint64_t, uint64_t>& hashes)
+{
+    uint64_t range_end = end < data_parts.size() ? data_parts[end].first : file_size;
+
+    // Reads block, that begins at given position. If contents are
+    // not checked, then only the data part headers are needed, so
+    // the block ends at the last header that fits in it.
+    Bytes block;
+    uint64_t block_pos = 0;
+    auto readBlock = [&](uint64_t pos, size_t data_part_index) {
+        uint64_t block_end = std::min(pos + VERIFY_BLOCK_SIZE, range_end);
+        if (!check_contents) {
+            block_end = pos;
+            for (size_t i = data_part_index; i < end; ++ i) {
+                uint64_t header_end = data_parts[i].first + (data_parts[i].second == MINUS_ONE ? DATAPART_FREESPACE_MIN_SIZE : datapart_header_size);
+                if (i > data_part_index && header_end > pos + VERIFY_BLOCK_SIZE) {
+                    break;
+                }
+                block_end = header_end;
+            }
+        }
+        block_pos = pos;
+        block.resize(block_end - pos);
+        readBytesAt(pos, &block[0], block.size());
+    };
+
+    for (size_t i = begin; i < end; ++ i) {
+        uint64_t data_part_pos = data_parts[i].first;
+        uint64_t data_part_size = (i + 1 < data_parts.size() ? data_parts[i + 1].first : file_size) - data_part_pos;
+        uint64_t chunk_id = data_parts[i].second;
+
+        if (chunk_id == MINUS_ONE) {
+            if (data_part_pos + DATAPART_FREESPACE_MIN_SIZE > block_pos + block.size()) {
+                readBlock(data_part_pos, i);
+            }
+            uint64_t size_and_type = decodeUInt64(&block[data_part_pos - block_pos]);
+            if (size_and_type != data_part_size) {
+                throw CorruptedFile();
+            }
+            continue;
+        }
+
+        if (data_part_size < datapart_header_size) {
+            throw CorruptedFile();
+        }
+        if (data_part_pos + datapart_header_size > block_pos + block.size()) {
+            readBlock(data_part_pos, i);
+        }
+        DataPartHeader header;
+        decodeDataPartHeader(header, &block[data_part_pos - block_pos]);
+        if (header.size != data_part_size || header.chunk_id != chunk_id) {
+            throw CorruptedFile();
+        }
+
+        // Only shared contents can have the flag, and they are not
+        // pointed by header parts. References are counted.
+        std::map<uint64_t, SharedContents>::const_iterator shared_contents_find = shared_contents.find(chunk_id);
+        bool shared = shared_contents_find != shared_contents.end() && shared_contents_find->second.pos == data_part_pos;
+        if (shared != ((header.flags & FLAG_SHARED) != 0)) {
+            throw CorruptedFile();
+        }
+        if (header.flags & FLAG_REFERENCE) {
+            uint64_t hash_pos = data_part_pos + datapart_header_size;
+            if (hash_pos + REFERENCE_SIZE <= block_pos + block.size()) {
+                ++ references[decodeUInt64(&block[hash_pos - block_pos])];
+            } else {
+                ++ references[readUInt64At(hash_pos)];
+            }
+        }
+        if (header.flags & FLAG_HASHED) {
+            uint64_t hash_pos = data_part_pos + datapart_header_size + getStoredSize(header) - CONTENT_HASH_SIZE;
+            uint64_t hash;
+            if (hash_pos + CONTENT_HASH_SIZE <= block_pos + block.size()) {
+                hash = decodeUInt64(&block[hash_pos - block_pos]);
+            } else {
+                hash = readUInt64At(hash_pos);
+            }
+            if (!hashes.insert(std::make_pair(hash, chunk_id)).second) {
+                throw CorruptedFile();
+            }
+        }
+
+        // Checksum is calculated in pieces, if contents do not fit in one block
+        if (check_contents && (header.flags & FLAG_CHECKSUM)) {
+            uint64_t contents_pos = data_part_pos + datapart_header_size;
+            uint64_t contents_end = contents_pos + header.contents_size;
+            uint32_t checksum = 0;
+            while (contents_pos < contents_end) {
+                if (contents_pos >= block_pos + block.size()) {
+                    readBlock(contents_pos, i);
+                }
+                uint64_t piece_size = std::min(contents_end, block_pos + block.size()) - contents_pos;
+                checksum = calculateCrc32c(&block[contents_pos - block_pos], piece_size, checksum);
+                contents_pos += piece_size;
+            }
+            if (contents_end + CHECKSUM_SIZE > block_pos + block.size()) {
+                readBlock(contents_end, i);
+            }
+            if (decodeUInt32(&block[contents_end - block_pos]) != checksum) {
+                throw CorruptedFile();
+            }
+        }
     }
 }
 
-void Chunkfile::optimizeDataParts()
+void Chunkfile::optimize()
 {
-// TODO: Code this!
+    Lock lock(this, true);
+    TransactionGuard transaction(this);
+    ++ stat_optimizations;
+
+    // Shared contents, whose references were lost in a crash
+    for (std::map<uint64_t, SharedContents>::iterator it = shared_contents.begin(); it != shared_contents.end(); ) {
+        if (it->second.references == 0) {
+            uint64_t datapart_pos = it->second.pos;
+            it = shared_contents.erase(it);
+            freeDataPart(datapart_pos);
+        } else {
+            ++ it;
+        }
+    }
+
+    optimizeHeaderParts();
+    optimizeDataParts();
+    writeHeader();
+
+    transaction.commit();
+}
+
+void Chunkfile::readHeader()
+{
+    readSeek(HEADER_MAGIC_AND_VERSION_SIZE);
+    chunks = readUInt64();
+    chunk_space_reserved = readUInt64();
+    total_data_part_empty_space = readUInt64();
+    if (hasSparseIds() && chunk_space_reserved % HEADERPARTS_PER_SLOT != 0) {
+        throw CorruptedFile();
+    }
+    if (options.cache_header_parts) {
+        loadHeaderParts();
+    }
+    free_ids_loaded = false;
+    free_ids.clear();
+    loadFreeSpaces();
+}
+
+void Chunkfile::writeHeader()
+{
+    file_size = std::max<uint64_t>(file_size, HEADER_SIZE);
+    assert(chunks <= chunk_space_reserved);
+    assert(HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE + total_data_part_empty_space <= file_size);
+    writeSeek(HEADER_MAGIC_AND_VERSION_SIZE);
+    writeUInt64(chunks);
+    writeUInt64(chunk_space_reserved);
+    writeUInt64(total_data_part_empty_space);
+}
+
+void Chunkfile::decodeDataPartHeader(DataPartHeader& header, uint8_t const* bytes)
+{
+    uint64_t size_and_type = decodeUInt64(bytes);
+    if ((size_and_type >> 63) != DATAPART_TYPE_DATA) {
+        throw CorruptedFile();
+    }
+    header.size = size_and_type & 0x7fffffffffffffff;
+    if (header.size < datapart_header_size) {
+        throw CorruptedFile();
+    }
+    header.chunk_id = decodeUInt64(bytes + 8);
+    if (version == 0) {
+        header.contents_size = header.size - DATAPART_HEADER_SIZE_V0;
+        header.codec = 0;
+        header.flags = 0;
+        return;
+    }
+    uint64_t contents_size_codec_and_flags = decodeUInt64(bytes + 16);
+    header.contents_size = contents_size_codec_and_flags & MAX_CONTENTS_SIZE;
+    header.codec = (contents_size_codec_and_flags >> 40) & 0xff;
+    header.flags = contents_size_codec_and_flags >> 48;
+    uint16_t known_flags = hasDeduplication() ? FLAG_CHECKSUM | FLAG_SHARED | FLAG_REFERENCE | FLAG_HASHED : FLAG_CHECKSUM;
+    if (header.codec > CODEC_LZ4 || (header.flags & ~known_flags) != 0) {
+        throw UnsupportedVersion();
+    }
+    if ((header.flags & FLAG_REFERENCE) && ((header.flags & FLAG_SHARED) || header.codec != CODEC_NONE || header.contents_size != REFERENCE_SIZE)) {
+        throw CorruptedFile();
+    }
+    if ((header.flags & FLAG_HASHED) && (header.flags & (FLAG_SHARED | FLAG_REFERENCE))) {
+        throw CorruptedFile();
+    }
+    if (getStoredSize(header) > header.size - datapart_header_size) {
+        throw CorruptedFile();
+    }
+}
+
+void Chunkfile::encodeDataPartHeader(uint8_t* bytes, DataPartHeader const& header)
+{
+    assert(header.size >= datapart_header_size + getStoredSize(header));
+    encodeUInt64(bytes, header.size + (uint64_t(DATAPART_TYPE_DATA) << 63));
+    encodeUInt64(bytes + 8, header.chunk_id);
+    if (version == 0) {
+        assert(header.size == DATAPART_HEADER_SIZE_V0 + header.contents_size);
+        assert(header.codec == 0 && header.flags == 0);
+        return;
+    }
+    encodeUInt64(bytes + 16, header.contents_size + (uint64_t(header.codec) << 40) + (uint64_t(header.flags) << 48));
+}
+
+void Chunkfile::readDataPartHeader(DataPartHeader& header, uint64_t pos)
+{
+    if (pos + datapart_header_size > file_size) {
+        throw CorruptedFile();
+    }
+    uint8_t bytes[DATAPART_HEADER_SIZE_V1];
+    readBytesAt(pos, bytes, datapart_header_size);
+    decodeDataPartHeader(header, bytes);
+    if (pos + header.size > file_size) {
+        throw CorruptedFile();
+    }
+}
+
+void Chunkfile::writeDataPart(uint64_t pos, DataPartHeader const& header, uint8_t const* contents, uint64_t hash)
+{
+    uint8_t bytes[DATAPART_HEADER_SIZE_V1];
+    encodeDataPartHeader(bytes, header);
+    writeSeek(pos);
+    writeBytes(bytes, datapart_header_size);
+    writeBytes(contents, header.contents_size);
+    if (header.flags & FLAG_CHECKSUM) {
+        uint8_t checksum[CHECKSUM_SIZE];
+        encodeUInt32(checksum, calculateCrc32c(contents, header.contents_size));
+        writeBytes(checksum, CHECKSUM_SIZE);
+    }
+    if (header.flags & FLAG_HASHED) {
+        uint8_t hash_bytes[CONTENT_HASH_SIZE];
+        encodeUInt64(hash_bytes, hash);
+        writeBytes(hash_bytes, CONTENT_HASH_SIZE);
+    }
+    // If there is unused space at the end of the file,
+    // then make sure the file is big enough.
+    uint64_t end = pos + header.size;
+    if (end == file_size && datapart_header_size + getStoredSize(header) < header.size) {
+        extendFile(end);
+    }
+}
+
+uint64_t Chunkfile::getDataPartSize(uint64_t contents_size, bool growing)
+{
+    uint64_t size = datapart_header_size + contents_size;
+    if (version == 0 || (options.capacity_policy == Options::CAPACITY_EXACT && !growing)) {
+        return size;
+    }
+    uint64_t rounded_size = 1;
+    while (rounded_size < size) {
+        rounded_size *= 2;
+    }
+    return rounded_size;
+}
+
+uint64_t Chunkfile::resizeDataPartInPlace(uint64_t pos, uint64_t size, uint64_t contents_size, bool growing)
+{
+    uint64_t needed_size = datapart_header_size + contents_size;
+    uint64_t wanted_size = getDataPartSize(contents_size, growing);
+    // Version 0 does not support unused space in data parts
+    bool unused_space_allowed = version > 0;
+
+    // If data part is at the end of file, then it can be resized freely
+    if (pos + size == file_size) {
+        file_size = pos + wanted_size;
+        if (wanted_size < size) {
+            truncateFile(file_size);
+        }
+        return wanted_size;
+    }
+
+    if (size < needed_size) {
+        // Data part needs to grow, so there must be free space after it
+        std::map<uint64_t, uint64_t>::const_iterator next_free_space = free_spaces.find(pos + size);
+        if (next_free_space == free_spaces.end()) {
+            return 0;
+        }
+        uint64_t available_size = size + next_free_space->second;
+        uint64_t new_size;
+        if (available_size >= wanted_size + DATAPART_FREESPACE_MIN_SIZE) {
+            new_size = wanted_size;
+        } else if (available_size == needed_size || (available_size > needed_size && unused_space_allowed)) {
+            new_size = available_size;
+        } else if (available_size >= needed_size + DATAPART_FREESPACE_MIN_SIZE) {
+            new_size = needed_size;
+        } else {
+            return 0;
+        }
+        // Take the free space, and leave the rest of it
+        removeFreeSpace(pos + size);
+        assert(total_data_part_empty_space >= available_size - size);
+        total_data_part_empty_space -= available_size - size;
+        if (new_size < available_size) {
+            writeSeek(pos + new_size);
+            writeUInt63AndUInt1(available_size - new_size, DATAPART_TYPE_FREESPACE);
+            addFreeSpace(pos + new_size, available_size - new_size);
+            total_data_part_empty_space += available_size - new_size;
+        }
+        return new_size;
+    }
+
+    // Data part is big enough. If it has too much unused space, then
+    // make it smaller. With extra capacity, some more is allowed, so
+    // chunks that change size back and forth do not need resizing.
+    uint64_t max_size = options.capacity_policy == Options::CAPACITY_EXACT ? wanted_size : wanted_size * 2;
+    if (size == needed_size || (size <= max_size && unused_space_allowed)) {
+        return size;
+    }
+    if (size < wanted_size + DATAPART_FREESPACE_MIN_SIZE) {
+        return unused_space_allowed ? size : 0;
+    }
+    releaseSpace(pos + wanted_size, size - wanted_size);
+    return wanted_size;
+}
+
+uint64_t Chunkfile::findFreeSpace(uint64_t size, uint64_t min_limit)
+{
+    // If minimum limit is after the file size, then create
+    // some extra free space at the end of the file. This
+    // way it is possible to return the end of the file.
+    if (min_limit != MINUS_ONE && min_limit > file_size) {
+        // Calculate how much extra free space is needed. It needs
+        // to be at least the length of minimum sized datapart.
+        uint64_t new_free_space_size = std::max<uint64_t>(min_limit - file_size, DATAPART_FREESPACE_MIN_SIZE);
+
+        // Create new datapart of free space
+        writeSeek(file_size);
+        writeUInt63AndUInt1(new_free_space_size, DATAPART_TYPE_FREESPACE);
+        extendFile(file_size + new_free_space_size);
+
+        // Update counters
+        addFreeSpace(file_size, new_free_space_size);
+        file_size += new_free_space_size;
+        total_data_part_empty_space += new_free_space_size;
+        writeHeader();
+
+        return file_size;
+    }
+
+    uint64_t pos_limit = min_limit == MINUS_ONE ? 0 : min_limit;
+
+    // Find the smallest free space that is big enough. If the free
+    // space is bigger than required, then the remaining part must
+    // be big enough to contain a free space data part.
+    std::set<std::pair<uint64_t, uint64_t> >::const_iterator it = free_spaces_by_size.lower_bound(std::make_pair(size, 0));
+    for (; it != free_spaces_by_size.end(); ++ it) {
+        uint64_t free_space_size = it->first;
+        uint64_t free_space_pos = it->second;
+        if (free_space_pos < pos_limit) {
+            continue;
+        }
+        if (free_space_size == size || free_space_size >= size + DATAPART_FREESPACE_MIN_SIZE) {
+            return free_space_pos;
+        }
+    }
+
+    // If the last data part is too small free space, then
+    // it can be used by growing the end of the file.
+    if (!free_spaces.empty()) {
+        std::map<uint64_t, uint64_t>::const_iterator last = -- free_spaces.end();
+        if (last->first >= pos_limit && last->first + last->second == file_size && last->second < size) {
+            return last->first;
+        }
+    }
+
+    return file_size;
+}
+
+void Chunkfile::useFreeSpace(uint64_t pos, uint64_t size)
+{
+    // If end of file
+    if (pos == file_size) {
+        file_size += size;
+        return;
+    }
+
+    std::map<uint64_t, uint64_t>::const_iterator free_spaces_find = free_spaces.find(pos);
+    if (free_spaces_find == free_spaces.end()) {
+        throw CorruptedFile();
+    }
+    uint64_t free_space_size = free_spaces_find->second;
+    removeFreeSpace(pos);
+    assert(total_data_part_empty_space >= free_space_size);
+    total_data_part_empty_space -= free_space_size;
+
+    // If free space is at the end of file and too small, then grow the file
+    if (free_space_size < size) {
+        if (pos + free_space_size != file_size) {
+            throw CorruptedFile();
+        }
+        file_size = pos + size;
+    }
+    // If there is some free space left, then "move" it after the new data part
+    else if (free_space_size > size) {
+        assert(free_space_size >= size + DATAPART_FREESPACE_MIN_SIZE);
+        uint64_t left_size = free_space_size - size;
+        writeSeek(pos + size);
+        writeUInt63AndUInt1(left_size, DATAPART_TYPE_FREESPACE);
+        addFreeSpace(pos + size, left_size);
+        total_data_part_empty_space += left_size;
+    }
+}
+
+void Chunkfile::loadHeaderParts()
+{
+    if (HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE > file_size) {
+        throw CorruptedFile();
+    }
+
+    // Read all header parts with one read
+    Bytes header_parts_bytes(chunk_space_reserved * HEADERPART_SIZE);
+    header_parts.assign(chunk_space_reserved, MINUS_ONE);
+    if (header_parts_bytes.empty()) {
+        return;
+    }
+    readSeek(HEADER_SIZE);
+    readBytes(&header_parts_bytes[0], header_parts_bytes.size());
+    for (uint64_t chunk_id = 0; chunk_id < chunk_space_reserved; ++ chunk_id) {
+        header_parts[chunk_id] = decodeUInt64(&header_parts_bytes[chunk_id * HEADERPART_SIZE]);
+    }
+}
+
+void Chunkfile::loadFreeIds()
+{
+    free_ids.clear();
+
+    // Read header parts in big blocks
+    uint64_t const BLOCK_CHUNKS = BATCH_IO_MAX_SIZE / HEADERPART_SIZE;
+    std::vector<uint64_t> chunk_ids;
+    std::vector<uint64_t> data_part_positions;
+    for (uint64_t first_chunk_id = 0; first_chunk_id < chunk_space_reserved; first_chunk_id += BLOCK_CHUNKS) {
+        chunk_ids.clear();
+        for (uint64_t chunk_id = first_chunk_id; chunk_id < std::min(first_chunk_id + BLOCK_CHUNKS, chunk_space_reserved); ++ chunk_id) {
+            chunk_ids.push_back(chunk_id);
+        }
+        readHeaderParts(data_part_positions, chunk_ids);
+        for (size_t i = 0; i < chunk_ids.size(); ++ i) {
+            if (data_part_positions[i] == MINUS_ONE) {
+                free_ids.insert(free_ids.end(), chunk_ids[i]);
+            }
+        }
+    }
+
+    free_ids_loaded = true;
+}
+
+uint64_t Chunkfile::findFreeId()
+{
+    if (hasSparseIds()) {
+        throw std::runtime_error("Chunk IDs can not be allocated when they are sparse!");
+    }
+    if (!free_ids_loaded) {
+        loadFreeIds();
+    }
+    // If all reserved chunks are in use, then use the first unreserved one
+    if (free_ids.empty()) {
+        return chunk_space_reserved;
+    }
+    return *free_ids.begin();
+}
+
+void Chunkfile::reserveForNewChunks(uint64_t max_chunk_id, uint64_t new_chunks)
+{
+    if (hasSparseIds()) {
+        if ((chunks + new_chunks) * 2 > getSlotCount()) {
+            reserve((chunks + new_chunks) * 2);
+        }
+    } else if (max_chunk_id >= chunk_space_reserved) {
+        reserve(std::max(max_chunk_id + 1, chunk_space_reserved * 2));
+    }
+}
+
+uint64_t Chunkfile::getHomeSlot(uint64_t chunk_id, uint64_t slots)
+{
+    // Mix the bits, so that successive IDs are spread around
+    chunk_id ^= chunk_id >> 33;
+    chunk_id *= 0xff51afd7ed558ccdULL;
+    chunk_id ^= chunk_id >> 33;
+    chunk_id *= 0xc4ceb9fe1a85ec53ULL;
+    chunk_id ^= chunk_id >> 33;
+    return chunk_id % slots;
+}
+
+void Chunkfile::readSlot(uint64_t& chunk_id, uint64_t& datapart_pos, uint64_t slot)
+{
+    uint64_t index = slot * HEADERPARTS_PER_SLOT;
+    if (options.cache_header_parts) {
+        chunk_id = header_parts[index];
+        datapart_pos = header_parts[index + 1];
+        return;
+    }
+    uint8_t bytes[HEADERPARTS_PER_SLOT * HEADERPART_SIZE];
+    readBytesAt(HEADER_SIZE + index * HEADERPART_SIZE, bytes, sizeof(bytes));
+    chunk_id = decodeUInt64(bytes);
+    datapart_pos = decodeUInt64(bytes + HEADERPART_SIZE);
+}
+
+void Chunkfile::writeSlot(uint64_t slot, uint64_t chunk_id, uint64_t datapart_pos)
+{
+    uint64_t index = slot * HEADERPARTS_PER_SLOT;
+    assert(index < chunk_space_reserved);
+    if (options.cache_header_parts) {
+        header_parts[index] = chunk_id;
+        header_parts[index + 1] = datapart_pos;
+    }
+    writeSeek(HEADER_SIZE + index * HEADERPART_SIZE);
+    writeUInt64(chunk_id);
+    writeUInt64(datapart_pos);
+}
+
+uint64_t Chunkfile::findSlot(bool& found, uint64_t chunk_id)
+{
+    uint64_t slots = getSlotCount();
+    assert(slots > 0);
+    uint64_t slot = getHomeSlot(chunk_id, slots);
+    for (uint64_t i = 0; i < slots; ++ i) {
+        uint64_t slot_chunk_id;
+        uint64_t slot_datapart_pos;
+        readSlot(slot_chunk_id, slot_datapart_pos, slot);
+        if (slot_datapart_pos == MINUS_ONE) {
+            found = false;
+            return slot;
+        }
+        if (slot_chunk_id == chunk_id) {
+            found = true;
+            return slot;
+        }
+        slot = (slot + 1) % slots;
+    }
+    // Table is never full
+    throw CorruptedFile();
+}
+
+void Chunkfile::removeSlot(uint64_t slot)
+{
+    uint64_t slots = getSlotCount();
+    uint64_t next_slot = (slot + 1) % slots;
+    while (true) {
+        uint64_t chunk_id;
+        uint64_t datapart_pos;
+        readSlot(chunk_id, datapart_pos, next_slot);
+        if (datapart_pos == MINUS_ONE) {
+            break;
+        }
+        // Chunk can be moved to the empty slot, if
+        // its home slot is not after the empty slot.
+        uint64_t home_slot = getHomeSlot(chunk_id, slots);
+        if ((next_slot + slots - home_slot) % slots >= (next_slot + slots - slot) % slots) {
+            writeSlot(slot, chunk_id, datapart_pos);
+            slot = next_slot;
+        }
+        next_slot = (next_slot + 1) % slots;
+    }
+    writeSlot(slot, MINUS_ONE, MINUS_ONE);
+}
+
+void Chunkfile::rehashSlots(uint64_t new_reserve)
+{
+    assert(new_reserve % HEADERPARTS_PER_SLOT == 0);
+    std::vector<uint64_t> old_header_parts;
+    if (options.cache_header_parts) {
+        old_header_parts.swap(header_parts);
+    } else {
+        Bytes bytes(chunk_space_reserved * HEADERPART_SIZE);
+        readSeek(HEADER_SIZE);
+        readBytes(bytes.data(), bytes.size());
+        old_header_parts.resize(chunk_space_reserved);
+        for (uint64_t i = 0; i < chunk_space_reserved; ++ i) {
+            old_header_parts[i] = decodeUInt64(&bytes[i * HEADERPART_SIZE]);
+        }
+    }
+
+    std::vector<uint64_t> new_header_parts(new_reserve, MINUS_ONE);
+    uint64_t new_slots = new_reserve / HEADERPARTS_PER_SLOT;
+    for (uint64_t i = 0; i < old_header_parts.size(); i += HEADERPARTS_PER_SLOT) {
+        uint64_t chunk_id = old_header_parts[i];
+        uint64_t datapart_pos = old_header_parts[i + 1];
+        if (datapart_pos == MINUS_ONE) {
+            continue;
+        }
+        uint64_t slot = getHomeSlot(chunk_id, new_slots);
+        while (new_header_parts[slot * HEADERPARTS_PER_SLOT + 1] != MINUS_ONE) {
+            slot = (slot + 1) % new_slots;
+        }
+        new_header_parts[slot * HEADERPARTS_PER_SLOT] = chunk_id;
+        new_header_parts[slot * HEADERPARTS_PER_SLOT + 1] = datapart_pos;
+    }
+
+    Bytes bytes;
+    bytes.reserve(new_reserve * HEADERPART_SIZE);
+    for (uint64_t i = 0; i < new_reserve; ++ i) {
+        appendUInt64(bytes, new_header_parts[i]);
+    }
+    writeSeek(HEADER_SIZE);
+    writeBytes(bytes.data(), bytes.size());
+    if (options.cache_header_parts) {
+        header_parts.swap(new_header_parts);
+    }
+}
+
+uint64_t Chunkfile::readHeaderPart(uint64_t chunk_id)
+{
+    if (hasSparseIds()) {
+        if (chunk_space_reserved == 0) {
+            return MINUS_ONE;
+        }
+        bool found;
+        uint64_t slot = findSlot(found, chunk_id);
+        if (!found) {
+            return MINUS_ONE;
+        }
+        uint64_t slot_chunk_id;
+        uint64_t datapart_pos;
+        readSlot(slot_chunk_id, datapart_pos, slot);
+        return datapart_pos;
+    }
+    assert(chunk_id < chunk_space_reserved);
+    if (options.cache_header_parts) {
+        return header_parts[chunk_id];
+    }
+    return readUInt64At(HEADER_SIZE + chunk_id * HEADERPART_SIZE);
+}
+
+void Chunkfile::writeHeaderPart(uint64_t chunk_id, uint64_t datapart_pos)
+{
+    if (hasSparseIds()) {
+        if (chunk_space_reserved == 0) {
+            assert(datapart_pos == MINUS_ONE);
+            return;
+        }
+        bool found;
+        uint64_t slot = findSlot(found, chunk_id);
+        if (datapart_pos != MINUS_ONE) {
+            writeSlot(slot, chunk_id, datapart_pos);
+        } else if (found) {
+            removeSlot(slot);
+        }
+        return;
+    }
+    assert(chunk_id < chunk_space_reserved);
+    if (options.cache_header_parts) {
+        header_parts[chunk_id] = datapart_pos;
+    }
+    if (free_ids_loaded) {
+        if (datapart_pos == MINUS_ONE) {
+            free_ids.insert(chunk_id);
+        } else {
+            free_ids.erase(chunk_id);
+        }
+    }
+    writeSeek(HEADER_SIZE + chunk_id * HEADERPART_SIZE);
+    writeUInt64(datapart_pos);
+}
+
+void Chunkfile::readHeaderParts(std::vector<uint64_t>& results, std::vector<uint64_t> const& chunk_ids)
+{
+    results.assign(chunk_ids.size(), MINUS_ONE);
+
+    // Chunks are searched one by one from the hash table
+    if (hasSparseIds()) {
+        for (size_t i = 0; i < chunk_ids.size(); ++ i) {
+            results[i] = readHeaderPart(chunk_ids[i]);
+        }
+        return;
+    }
+
+    // Read header parts in the order they are in the file
+    std::vector<std::pair<uint64_t, size_t> > reads;
+    reads.reserve(chunk_ids.size());
+    for (size_t i = 0; i < chunk_ids.size(); ++ i) {
+        if (chunk_ids[i] < chunk_space_reserved) {
+            reads.push_back(std::make_pair(chunk_ids[i], i));
+        }
+    }
+    if (options.cache_header_parts) {
+        for (size_t i = 0; i < reads.size(); ++ i) {
+            results[reads[i].second] = header_parts[reads[i].first];
+        }
+        return;
+    }
+    std::sort(reads.begin(), reads.end());
+
+    // Header parts that are near each others are read with a single read
+    Bytes block;
+    for (size_t i = 0; i < reads.size(); ) {
+        uint64_t first_chunk_id = reads[i].first;
+        size_t end = i + 1;
+        while (end < reads.size() && (reads[end].first - first_chunk_id + 1) * HEADERPART_SIZE <= BATCH_IO_MAX_GAP) {
+            ++ end;
+        }
+        uint64_t last_chunk_id = reads[end - 1].first;
+        block.resize((last_chunk_id - first_chunk_id + 1) * HEADERPART_SIZE);
+        readBytesAt(HEADER_SIZE + first_chunk_id * HEADERPART_SIZE, &block[0], block.size());
+        for (; i < end; ++ i) {
+            results[reads[i].second] = decodeUInt64(&block[(reads[i].first - first_chunk_id) * HEADERPART_SIZE]);
+        }
+    }
+}
+
+void Chunkfile::writeHeaderParts(std::vector<std::pair<uint64_t, uint64_t> > const& header_parts_to_write)
+{
+    if (hasSparseIds()) {
+        for (size_t i = 0; i < header_parts_to_write.size(); ++ i) {
+            writeHeaderPart(header_parts_to_write[i].first, header_parts_to_write[i].second);
+        }
+        return;
+    }
+
+    // Header parts with successive chunk IDs are written at once
+    Bytes block;
+    for (size_t i = 0; i < header_parts_to_write.size(); ) {
+        uint64_t first_chunk_id = header_parts_to_write[i].first;
+        block.clear();
+        do {
+            uint64_t chunk_id = header_parts_to_write[i].first;
+            uint64_t datapart_pos = header_parts_to_write[i].second;
+            assert(chunk_id < chunk_space_reserved);
+            if (options.cache_header_parts) {
+                header_parts[chunk_id] = datapart_pos;
+            }
+            if (free_ids_loaded) {
+                if (datapart_pos == MINUS_ONE) {
+                    free_ids.insert(chunk_id);
+                } else {
+                    free_ids.erase(chunk_id);
+                }
+            }
+            appendUInt64(block, datapart_pos);
+            ++ i;
+        } while (i < header_parts_to_write.size() && header_parts_to_write[i].first == first_chunk_id + block.size() / HEADERPART_SIZE);
+        writeSeek(HEADER_SIZE + first_chunk_id * HEADERPART_SIZE);
+        writeBytes(&block[0], block.size());
+    }
+}
+
+void Chunkfile::loadFreeSpaces()
+{
+    free_spaces.clear();
+    free_spaces_by_size.clear();
+    shared_contents.clear();
+    hashed_contents.clear();
+    std::map<uint64_t, uint64_t> references;
+
+    uint64_t data_part_pos = HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE;
+    while (data_part_pos < file_size) {
+        readSeek(data_part_pos);
+        uint64_t data_part_size;
+        uint8_t data_part_type;
+        readUInt63AndUInt1(data_part_size, data_part_type);
+        if (data_part_size < DATAPART_FREESPACE_MIN_SIZE) {
+            throw CorruptedFile();
+        }
+        if (data_part_type == DATAPART_TYPE_FREESPACE) {
+            addFreeSpace(data_part_pos, data_part_size);
+        } else if (hasDeduplication()) {
+            DataPartHeader header;
+            readDataPartHeader(header, data_part_pos);
+            if (header.flags & FLAG_SHARED) {
+                SharedContents shared = {data_part_pos, 0};
+                if (!shared_contents.insert(std::make_pair(header.chunk_id, shared)).second) {
+                    throw CorruptedFile();
+                }
+            } else if (header.flags & FLAG_REFERENCE) {
+                ++ references[readUInt64At(data_part_pos + datapart_header_size)];
+            } else if (header.flags & FLAG_HASHED) {
+                if (!hashed_contents.insert(std::make_pair(readContentHash(data_part_pos, header), header.chunk_id)).second) {
+                    throw CorruptedFile();
+                }
+            }
+        }
+        data_part_pos += data_part_size;
+    }
+    if (data_part_pos != file_size) {
+        throw CorruptedFile();
+    }
+
+    // Every reference must have its shared contents
+    for (std::map<uint64_t, uint64_t>::const_iterator it = references.begin(); it != references.end(); ++ it) {
+        std::map<uint64_t, SharedContents>::iterator shared_contents_find = shared_contents.find(it->first);
+        if (shared_contents_find == shared_contents.end()) {
+            throw CorruptedFile();
+        }
+        shared_contents_find->second.references = it->second;
+    }
+}
+
+void Chunkfile::addFreeSpace(uint64_t pos, uint64_t size)
+{
+    assert(free_spaces.find(pos) == free_spaces.end());
+    free_spaces[pos] = size;
+    free_spaces_by_size.insert(std::make_pair(size, pos));
+}
+
+void Chunkfile::releaseSpace(uint64_t pos, uint64_t size)
+{
+    uint64_t free_space_pos = pos;
+    uint64_t free_space_size = size;
+
+    // Merge with free spaces before and after
+    std::map<uint64_t, uint64_t>::const_iterator free_spaces_find = free_spaces.lower_bound(pos);
+    if (free_spaces_find != free_spaces.begin()) {
+        -- free_spaces_find;
+        if (free_spaces_find->first + free_spaces_find->second == pos) {
+            free_space_pos = free_spaces_find->first;
+            free_space_size += free_spaces_find->second;
+            removeFreeSpace(free_space_pos);
+            assert(total_data_part_empty_space >= free_space_size - size);
+            total_data_part_empty_space -= free_space_size - size;
+        }
+    }
+    free_spaces_find = free_spaces.find(pos + size);
+    if (free_spaces_find != free_spaces.end()) {
+        uint64_t next_size = free_spaces_find->second;
+        free_space_size += next_size;
+        removeFreeSpace(pos + size);
+        assert(total_data_part_empty_space >= next_size);
+        total_data_part_empty_space -= next_size;
+    }
+
+    // If free space is at the end of file, then get rid of it
+    if (free_space_pos + free_space_size == file_size) {
+        file_size = free_space_pos;
+        truncateFile(file_size);
+        return;
+    }
+
+    writeSeek(free_space_pos);
+    writeUInt63AndUInt1(free_space_size, DATAPART_TYPE_FREESPACE);
+    addFreeSpace(free_space_pos, free_space_size);
+    total_data_part_empty_space += free_space_size;
+
+    // Release disk space of big areas. With write ahead log, the old
+    // contents are needed until the transaction is applied, so keep them.
+    if (size >= PUNCH_HOLE_MIN_SIZE && !options.write_ahead_log) {
+        uint64_t hole_begin = std::max(pos, free_space_pos + DATAPART_FREESPACE_MIN_SIZE);
+        hole_begin = (hole_begin + PUNCH_HOLE_BLOCK_SIZE - 1) / PUNCH_HOLE_BLOCK_SIZE * PUNCH_HOLE_BLOCK_SIZE;
+        uint64_t hole_end = (pos + size) / PUNCH_HOLE_BLOCK_SIZE * PUNCH_HOLE_BLOCK_SIZE;
+        if (hole_begin < hole_end) {
+            // Buffered writes to the old contents must not fill the hole
+            applyPendingWrites();
+            backend->punchHole(hole_begin, hole_end - hole_begin);
+        }
+    }
+}
+
+void Chunkfile::removeFreeSpace(uint64_t pos)
+{
+    std::map<uint64_t, uint64_t>::iterator free_spaces_find = free_spaces.find(pos);
+    assert(free_spaces_find != free_spaces.end());
+    free_spaces_by_size.erase(std::make_pair(free_spaces_find->second, pos));
+    free_spaces.erase(free_spaces_find);
+}
+
+uint64_t Chunkfile::getDataPartPosition(uint64_t chunk_id)
+{
+    if (!hasSparseIds() && chunk_id >= chunk_space_reserved) {
+        throw ChunkDoesNotExist();
+    }
+    uint64_t data_part_pos = readHeaderPart(chunk_id);
+    if (data_part_pos == MINUS_ONE) {
+        throw ChunkDoesNotExist();
+    }
+    return data_part_pos;
+}
+
+void Chunkfile::addAsyncOperation(uint64_t chunk_id, std::function<void()> const& run)
+{
+    // Use position of data part if it is known without
+    // reading, otherwise use position of header part.
+    AsyncOperation operation;
+    operation.pos = HEADER_SIZE + chunk_id * HEADERPART_SIZE;
+    operation.run = run;
+    if (options.cache_header_parts) {
+        Lock lock(this, false);
+        if (hasSparseIds() || chunk_id < chunk_space_reserved) {
+            uint64_t data_part_pos = readHeaderPart(chunk_id);
+            if (data_part_pos != MINUS_ONE) {
+                operation.pos = data_part_pos;
+            }
+        }
+    }
+
+    std::unique_lock<std::mutex> async_lock(async_mutex);
+    if (async_threads.empty()) {
+        for (unsigned i = 0; i < std::max(options.async_threads, 1u); ++ i) {
+            async_threads.push_back(std::thread(&Chunkfile::runAsyncOperations, this));
+        }
+    }
+    std::deque<AsyncOperation>& queue = async_queues[chunk_id];
+    queue.push_back(operation);
+    // If there is nothing before this, then it can be run immediately
+    if (queue.size() == 1) {
+        async_ready.insert(std::make_pair(operation.pos, chunk_id));
+        async_ready_cond.notify_one();
+    }
+}
+
+void Chunkfile::runAsyncOperations()
+{
+    std::unique_lock<std::mutex> async_lock(async_mutex);
+    while (true) {
+        while (async_ready.empty() && !async_stopping) {
+            async_ready_cond.wait(async_lock);
+        }
+        // When stopping, operations that are not ready yet
+        // are run by the threads that run the ones before them.
+        if (async_ready.empty()) {
+            return;
+        }
+
+        // Continue from the previous position, or start again from the beginning
+        std::multimap<uint64_t, uint64_t>::iterator ready_it = async_ready.lower_bound(async_pos);
+        if (ready_it == async_ready.end()) {
+            ready_it = async_ready.begin();
+        }
+        async_pos = ready_it->first;
+        uint64_t chunk_id = ready_it->second;
+        async_ready.erase(ready_it);
+
+        // Operation stays in the queue while it runs,
+        // so the next ones of the same chunk have to wait.
+        std::map<uint64_t, std::deque<AsyncOperation> >::iterator queue_it = async_queues.find(chunk_id);
+        std::function<void()> run;
+        run.swap(queue_it->second.front().run);
+        async_lock.unlock();
+        run();
+        async_lock.lock();
+
+        queue_it->second.pop_front();
+        if (queue_it->second.empty()) {
+            async_queues.erase(queue_it);
+        } else {
+            async_ready.insert(std::make_pair(queue_it->second.front().pos, chunk_id));
+        }
+    }
+}
+
+void Chunkfile::stopAsyncThreads()
+{
+    {
+        std::unique_lock<std::mutex> async_lock(async_mutex);
+        async_stopping = true;
+    }
+    async_ready_cond.notify_all();
+    for (std::thread& thread : async_threads) {
+        thread.join();
+    }
+    async_threads.clear();
+}
+
+void Chunkfile::writeToChunk(uint64_t chunk_id, uint64_t offset, uint8_t const* bytes, uint64_t size)
+{
+    uint64_t datapart_pos = getDataPartPosition(chunk_id);
+    DataPartHeader header;
+    readDataPartHeader(header, datapart_pos);
+    if (header.chunk_id != chunk_id || datapart_pos + header.size > file_size) {
+        throw CorruptedFile();
+    }
+
+    // Compressed and shared chunks can not be modified partially
+    if (header.codec != CODEC_NONE || (header.flags & FLAG_REFERENCE)) {
+        uint64_t contents_pos;
+        uint64_t contents_size;
+        uint8_t codec;
+        findChunkContents(contents_pos, contents_size, codec, chunk_id);
+        Bytes contents;
+        readContents(contents, contents_pos, contents_size, codec);
+        if (offset == MINUS_ONE) {
+            offset = contents.size();
+        }
+        if (offset > contents.size()) {
+            throw std::runtime_error("Offset is past the end of chunk!");
+        }
+        contents.resize(std::max<uint64_t>(contents.size(), offset + size));
+        std::copy(bytes, bytes + size, contents.begin() + offset);
+        set(chunk_id, contents);
+        return;
+    }
+
+    if (offset == MINUS_ONE) {
+        offset = header.contents_size;
+    }
+    if (offset > header.contents_size) {
+        throw std::runtime_error("Offset is past the end of chunk!");
+    }
+    stat_bytes_set += size;
+    DataPartHeader new_header = header;
+    new_header.contents_size = std::max(header.contents_size, offset + size);
+    if (version > 0 && new_header.contents_size > MAX_CONTENTS_SIZE) {
+        throw std::runtime_error("Chunk is too big!");
+    }
+
+    // Hashing the modified contents would need all of them,
+    // so the hash is dropped and they can not be shared.
+    if (header.flags & FLAG_HASHED) {
+        hashed_contents.erase(readContentHash(datapart_pos, header));
+        new_header.flags &= ~FLAG_HASHED;
+    }
+
+    // Calculate the new checksum before anything is moved. If bytes
+    // are appended, then the old checksum can be continued.
+    uint32_t checksum = 0;
+    if (header.flags & FLAG_CHECKSUM) {
+        uint64_t contents_pos = datapart_pos + datapart_header_size;
+        if (offset == header.contents_size) {
+            uint8_t old_checksum[CHECKSUM_SIZE];
+            readBytesAt(contents_pos + header.contents_size, old_checksum, CHECKSUM_SIZE);
+            checksum = decodeUInt32(old_checksum);
+        } else {
+            checksum = calculateCrc32cOfFile(contents_pos, offset, 0);
+        }
+        checksum = calculateCrc32c(bytes, size, checksum);
+        if (offset + size < header.contents_size) {
+            checksum = calculateCrc32cOfFile(contents_pos + offset + size, header.contents_size - offset - size, checksum);
+        }
+    }
+
+    // Data part needs to grow, if the new contents do not fit in it. If it
+    // can not grow in place, then the old contents are copied to new place.
+    uint64_t stored_size = getStoredSize(new_header);
+    if (datapart_header_size + stored_size > header.size) {
+        new_header.size = resizeDataPartInPlace(datapart_pos, header.size, stored_size, true);
+        if (new_header.size == 0) {
+            ++ stat_data_part_moves;
+            new_header.size = getDataPartSize(stored_size, true);
+            uint64_t new_datapart_pos = findFreeSpace(new_header.size);
+            useFreeSpace(new_datapart_pos, new_header.size);
+            copyBytes(new_datapart_pos + datapart_header_size, datapart_pos + datapart_header_size, offset);
+            releaseSpace(datapart_pos, header.size);
+            writeHeaderPart(chunk_id, new_datapart_pos);
+            datapart_pos = new_datapart_pos;
+        }
+    }
+
+    // Write only the parts that changed
+    if (new_header.size != header.size || new_header.contents_size != header.contents_size || new_header.flags != header.flags) {
+        uint8_t header_bytes[DATAPART_HEADER_SIZE_V1];
+        encodeDataPartHeader(header_bytes, new_header);
+        writeSeek(datapart_pos);
+        writeBytes(header_bytes, datapart_header_size);
+    }
+    writeSeek(datapart_pos + datapart_header_size + offset);
+    writeBytes(bytes, size);
+    if (new_header.flags & FLAG_CHECKSUM) {
+        uint8_t checksum_bytes[CHECKSUM_SIZE];
+        encodeUInt32(checksum_bytes, checksum);
+        writeSeek(datapart_pos + datapart_header_size + new_header.contents_size);
+        writeBytes(checksum_bytes, CHECKSUM_SIZE);
+    }
+    // If there is unused space at the end of the file,
+    // then make sure the file is big enough.
+    uint64_t end = datapart_pos + new_header.size;
+    if (end == file_size && datapart_header_size + stored_size < new_header.size) {
+        extendFile(end);
+    }
+
+    writeHeader();
+}
+
+uint32_t Chunkfile::calculateCrc32cOfFile(uint64_t pos, uint64_t size, uint32_t crc)
+{
+    Bytes buf(std::min<uint64_t>(size, COPY_BUF_SIZE));
+    for (uint64_t offset = 0; offset < size; offset += buf.size()) {
+        uint64_t piece_size = std::min<uint64_t>(size - offset, buf.size());
+        readBytesAt(pos + offset, &buf[0], piece_size);
+        crc = calculateCrc32c(&buf[0], piece_size, crc);
+    }
+    return crc;
+}
+
+void Chunkfile::findChunkContents(uint64_t& pos, uint64_t& size, uint8_t& codec, uint64_t chunk_id)
+{
+    uint64_t data_part_pos = getDataPartPosition(chunk_id);
+    DataPartHeader header;
+    readDataPartHeader(header, data_part_pos);
+    if (header.chunk_id != chunk_id) {
+        throw CorruptedFile();
+    }
+    if (header.flags & FLAG_REFERENCE) {
+        findSharedContents(pos, size, codec, readUInt64At(data_part_pos + datapart_header_size));
+        return;
+    }
+    pos = data_part_pos + datapart_header_size;
+    size = header.contents_size;
+    codec = header.codec;
+}
+
+void Chunkfile::findSharedContents(uint64_t& pos, uint64_t& size, uint8_t& codec, uint64_t hash)
+{
+    std::map<uint64_t, SharedContents>::const_iterator shared_contents_find = shared_contents.find(hash);
+    if (shared_contents_find == shared_contents.end()) {
+        throw CorruptedFile();
+    }
+    uint64_t data_part_pos = shared_contents_find->second.pos;
+    DataPartHeader header;
+    readDataPartHeader(header, data_part_pos);
+    if (!(header.flags & FLAG_SHARED) || header.chunk_id != hash) {
+        throw CorruptedFile();
+    }
+    pos = data_part_pos + datapart_header_size;
+    size = header.contents_size;
+    codec = header.codec;
+}
+
+uint64_t Chunkfile::calculateContentHash(uint8_t const* bytes, uint64_t size)
+{
+    uint64_t hash = calculateChecksum(bytes, size);
+    return hash == MINUS_ONE ? 0 : hash;
+}
+
+bool Chunkfile::addReference(uint64_t chunk_id, uint64_t hash, uint8_t const* bytes, uint64_t size)
+{
+    // Hashes of different contents may collide, so contents are compared
+    uint64_t contents_pos;
+    uint64_t contents_size;
+    uint8_t codec;
+    Bytes contents;
+    std::map<uint64_t, SharedContents>::iterator shared_contents_find = shared_contents.find(hash);
+    if (shared_contents_find != shared_contents.end()) {
+        findSharedContents(contents_pos, contents_size, codec, hash);
+        readContents(contents, contents_pos, contents_size, codec);
+        if (contents.size() != size || !std::equal(contents.begin(), contents.end(), bytes)) {
+            return false;
+        }
+        ++ shared_contents_find->second.references;
+        stat_bytes_deduplicated += size;
+        return true;
+    }
+
+    // Contents of the chunk itself are not shared with it
+    std::map<uint64_t, uint64_t>::iterator hashed_contents_find = hashed_contents.find(hash);
+    if (hashed_contents_find == hashed_contents.end() || hashed_contents_find->second == chunk_id) {
+        return false;
+    }
+    uint64_t other_chunk_id = hashed_contents_find->second;
+    findChunkContents(contents_pos, contents_size, codec, other_chunk_id);
+    readContents(contents, contents_pos, contents_size, codec);
+    if (contents.size() != size || !std::equal(contents.begin(), contents.end(), bytes)) {
+        return false;
+    }
+    hashed_contents.erase(hashed_contents_find);
+
+    // The other chunk gets a reference, and its old data part becomes
+    // the shared contents. Only the header of the data part is changed.
+    DataPartHeader reference_header;
+    reference_header.chunk_id = other_chunk_id;
+    reference_header.contents_size = REFERENCE_SIZE;
+    reference_header.codec = CODEC_NONE;
+    reference_header.flags = getNewDataPartFlags() | FLAG_REFERENCE;
+    reference_header.size = getDataPartSize(getStoredSize(reference_header));
+    uint64_t reference_pos = findFreeSpace(reference_header.size);
+    useFreeSpace(reference_pos, reference_header.size);
+    uint8_t reference[REFERENCE_SIZE];
+    encodeUInt64(reference, hash);
+    writeDataPart(reference_pos, reference_header, reference);
+
+    uint64_t datapart_pos = getDataPartPosition(other_chunk_id);
+    writeHeaderPart(other_chunk_id, reference_pos);
+    DataPartHeader header;
+    readDataPartHeader(header, datapart_pos);
+    header.chunk_id = hash;
+    header.flags = (header.flags & ~FLAG_HASHED) | FLAG_SHARED;
+    uint8_t header_bytes[DATAPART_HEADER_SIZE_V1];
+    encodeDataPartHeader(header_bytes, header);
+    writeSeek(datapart_pos);
+    writeBytes(header_bytes, datapart_header_size);
+    SharedContents shared = {datapart_pos, 2};
+    shared_contents[hash] = shared;
+    stat_bytes_deduplicated += size;
+    return true;
+}
+
+uint64_t Chunkfile::readContentHash(uint64_t datapart_pos, DataPartHeader const& header)
+{
+    assert(header.flags & FLAG_HASHED);
+    return readUInt64At(datapart_pos + datapart_header_size + getStoredSize(header) - CONTENT_HASH_SIZE);
+}
+
+void Chunkfile::releaseReference(uint64_t hash)
+{
+    std::map<uint64_t, SharedContents>::iterator shared_contents_find = shared_contents.find(hash);
+    if (shared_contents_find == shared_contents.end() || shared_contents_find->second.references == 0) {
+        throw CorruptedFile();
+    }
+    if (-- shared_contents_find->second.references > 0) {
+        return;
+    }
+    uint64_t datapart_pos = shared_contents_find->second.pos;
+    shared_contents.erase(shared_contents_find);
+    freeDataPart(datapart_pos);
+}
+
+void Chunkfile::readContents(Bytes& result, uint64_t pos, uint64_t size, uint8_t codec)
+{
+    if (codec == CODEC_NONE) {
+        result.resize(size);
+        if (size > 0) {
+            readBytesAt(pos, &result[0], size);
+        }
+        return;
+    }
+    Bytes compressed(size);
+    if (size > 0) {
+        readBytesAt(pos, &compressed[0], size);
+    }
+    decompressContents(result, compressed.data(), compressed.size(), codec);
+}
+
+bool Chunkfile::compressContents(Bytes& result, uint8_t const* bytes, uint64_t size)
+{
+    if (size < COMPRESSION_MIN_SIZE) {
+        return false;
+    }
+    result.clear();
+    appendUInt64(result, size);
+    compressLz4(result, bytes, size);
+    return result.size() < size;
+}
+
+void Chunkfile::decompressContents(Bytes& result, uint8_t const* bytes, uint64_t size, uint8_t codec)
+{
+    if (codec != CODEC_LZ4 || size < 8) {
+        throw CorruptedFile();
+    }
+    // Every byte of LZ4 can produce at most 255 bytes
+    uint64_t result_size = decodeUInt64(bytes);
+    if (result_size / 255 > size) {
+        throw CorruptedFile();
+    }
+    result.resize(result_size);
+    decompressLz4(result.data(), result.size(), bytes + 8, size - 8);
+}
+
+// LZ4 block format. Contents are a list of sequences. Every sequence
+// has some literal bytes, and then a match, which copies bytes from
+// earlier in the output. The last sequence has only literal bytes.
+// Sequence begins with a token, that has literal length in high four
+// bits, and match length minus four in low four bits. If a length is
+// 15 or more, then more bytes are added to it, until a byte is not
+// 255. Literal length bytes are followed by the literal bytes, then
+// a 16 bit offset of the match, and then more match length bytes.
+static void appendLz4Length(Chunkfile::Bytes& result, uint64_t length)
+{
+    while (length >= 255) {
+        result.push_back(255);
+        length -= 255;
+    }
+    result.push_back(length);
+}
+
+void Chunkfile::compressLz4(Bytes& result, uint8_t const* bytes, uint64_t size)
+{
+    // Matches must not start in the last 12 bytes, and
+    // they must leave the last five bytes as literals.
+    uint64_t const MATCH_START_LIMIT = 12;
+    uint64_t const LAST_LITERALS = 5;
+    unsigned const HASH_BITS = 12;
+
+    // Positions of earlier four byte sequences by their hash
+    std::vector<uint64_t> positions(1 << HASH_BITS, MINUS_ONE);
+
+    uint64_t literals_begin = 0;
+    uint64_t pos = 0;
+    while (pos + MATCH_START_LIMIT < size) {
+        uint32_t sequence = decodeUInt32(bytes + pos);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+        uint64_t match_pos = positions[hash];
+        positions[hash] = pos;
+        if (match_pos == MINUS_ONE || pos - match_pos > 0xffff || decodeUInt32(bytes + match_pos) != sequence) {
+            ++ pos;
+            continue;
+        }
+
+        // Find how long the match is
+        uint64_t match_end = pos + 4;
+        while (match_end < size - LAST_LITERALS && bytes[match_end] == bytes[match_pos + match_end - pos]) {
+            ++ match_end;
+        }
+
+        uint64_t literals_size = pos - literals_begin;
+        uint64_t match_size = match_end - pos - 4;
+        result.push_back((std::min<uint64_t>(literals_size, 15) << 4) + std::min<uint64_t>(match_size, 15));
+        if (literals_size >= 15) {
+            appendLz4Length(result, literals_size - 15);
+        }
+        result.insert(result.end(), bytes + literals_begin, bytes + pos);
+        result.push_back((pos - match_pos) & 0xff);
+        result.push_back((pos - match_pos) >> 8);
+        if (match_size >= 15) {
+            appendLz4Length(result, match_size - 15);
+        }
+
+        pos = match_end;
+        literals_begin = pos;
+    }
+
+    // The last sequence
+    uint64_t literals_size = size - literals_begin;
+    result.push_back(std::min<uint64_t>(literals_size, 15) << 4);
+    if (literals_size >= 15) {
+        appendLz4Length(result, literals_size - 15);
+    }
+    result.insert(result.end(), bytes + literals_begin, bytes + size);
+}
+
+void Chunkfile::decompressLz4(uint8_t* result, uint64_t result_size, uint8_t const* bytes, uint64_t size)
+{
+    uint64_t pos = 0;
+    uint64_t result_pos = 0;
+    while (true) {
+        if (pos >= size) {
+            throw CorruptedFile();
+        }
+        uint8_t token = bytes[pos ++];
+
+        // Literals
+        uint64_t literals_size = token >> 4;
+        if (literals_size == 15) {
+            uint8_t length_byte;
+            do {
+                if (pos >= size) {
+                    throw CorruptedFile();
+                }
+                length_byte = bytes[pos ++];
+                literals_size += length_byte;
+            } while (length_byte == 255);
+        }
+        if (literals_size > size - pos || literals_size > result_size - result_pos) {
+            throw CorruptedFile();
+        }
+        std::copy(bytes + pos, bytes + pos + literals_size, result + result_pos);
+        pos += literals_size;
+        result_pos += literals_size;
+
+        // The last sequence does not have a match
+        if (pos == size) {
+            break;
+        }
+
+        // Match
+        if (size - pos < 2) {
+            throw CorruptedFile();
+        }
+        uint64_t offset = bytes[pos] + (uint64_t(bytes[pos + 1]) << 8);
+        pos += 2;
+        uint64_t match_size = (token & 0x0f) + 4;
+        if ((token & 0x0f) == 15) {
+            uint8_t length_byte;
+            do {
+                if (pos >= size) {
+                    throw CorruptedFile();
+                }
+                length_byte = bytes[pos ++];
+                match_size += length_byte;
+            } while (length_byte == 255);
+        }
+        if (offset == 0 || offset > result_pos || match_size > result_size - result_pos) {
+            throw CorruptedFile();
+        }
+        // Match may overlap with itself, so copy byte by byte
+        for (uint64_t i = 0; i < match_size; ++ i) {
+            result[result_pos + i] = result[result_pos - offset + i];
+        }
+        result_pos += match_size;
+    }
+    if (result_pos != result_size) {
+        throw CorruptedFile();
+    }
+}
+
+void Chunkfile::freeDataPart(uint64_t datapart_pos)
+{
+    uint64_t reference = MINUS_ONE;
+    if (hasDeduplication()) {
+        DataPartHeader header;
+        readDataPartHeader(header, datapart_pos);
+        if (header.flags & FLAG_REFERENCE) {
+            reference = readUInt64At(datapart_pos + datapart_header_size);
+        } else if (header.flags & FLAG_HASHED) {
+            hashed_contents.erase(readContentHash(datapart_pos, header));
+        }
+    }
+
+    // Convert data part to empty space
+    readSeek(datapart_pos);
+    uint64_t datapart_size;
+    uint8_t datapart_type;
+    readUInt63AndUInt1(datapart_size, datapart_type);
+    if (datapart_type != DATAPART_TYPE_DATA) {
+        throw CorruptedFile();
+    }
+    if (datapart_pos + datapart_size > file_size) {
+        throw CorruptedFile();
+    }
+    releaseSpace(datapart_pos, datapart_size);
+
+    // Shared contents are freed after the data part that referred
+    // to them, so there is never a reference to freed contents.
+    if (reference != MINUS_ONE) {
+        releaseReference(reference);
+    }
+}
+
+void Chunkfile::moveDataPart(uint64_t datapart_pos, uint64_t new_datapart_pos)
+{
+    // Read datapart information
+    DataPartHeader header;
+    readDataPartHeader(header, datapart_pos);
+    if (!(header.flags & FLAG_SHARED) && !hasSparseIds() && header.chunk_id >= chunk_space_reserved) {
+        throw CorruptedFile();
+    }
+
+    // Copy to new position
+    ++ stat_data_part_moves;
+    useFreeSpace(new_datapart_pos, header.size);
+    copyBytes(new_datapart_pos, datapart_pos, header.size);
+    // Convert old position to free space
+    releaseSpace(datapart_pos, header.size);
+
+    // Update chunk
+    updateDataPartPosition(header, new_datapart_pos);
+
+    writeHeader();
+}
+
+void Chunkfile::updateDataPartPosition(DataPartHeader const& header, uint64_t datapart_pos)
+{
+    if (header.flags & FLAG_SHARED) {
+        std::map<uint64_t, SharedContents>::iterator shared_contents_find = shared_contents.find(header.chunk_id);
+        if (shared_contents_find == shared_contents.end()) {
+            throw CorruptedFile();
+        }
+        shared_contents_find->second.pos = datapart_pos;
+        return;
+    }
+    writeHeaderPart(header.chunk_id, datapart_pos);
+}
+
+void Chunkfile::optimizeIfNeeded()
+{
+    // Check if it would be good time to do some optimizations. Hash
+    // table of sparse IDs has four header parts per chunk after growing.
+    uint64_t min_header_parts_per_chunk = hasSparseIds() ? 4 * OPTIMIZE_THRESHOLD : OPTIMIZE_THRESHOLD;
+    if (chunks * min_header_parts_per_chunk <= chunk_space_reserved) {
+        ++ stat_optimizations;
+        optimizeHeaderParts();
+    }
+    uint64_t data_area_begin = HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE;
+    uint64_t data_area_size = file_size - data_area_begin;
+    uint64_t actual_data_size = data_area_size - total_data_part_empty_space;
+    if (actual_data_size * OPTIMIZE_THRESHOLD <= data_area_size) {
+        ++ stat_optimizations;
+        optimizeDataParts(OPTIMIZE_DATA_PARTS_STEP_SIZE);
+    }
+}
+
+void Chunkfile::optimizeHeaderParts()
+{
+    // Hash table is shrunk to the size it would have after growing
+    if (hasSparseIds()) {
+        uint64_t new_reserve = chunks * 2 * 2 * HEADERPARTS_PER_SLOT;
+        if (new_reserve < chunk_space_reserved) {
+            rehashSlots(new_reserve);
+            uint64_t data_area_move = (chunk_space_reserved - new_reserve) * HEADERPART_SIZE;
+            chunk_space_reserved = new_reserve;
+            releaseSpace(HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE, data_area_move);
+        }
+        return;
+    }
+
+    // Calculate how many empty chunks are at the end of header area
+    uint64_t empty_chunks_at_end = 0;
+    while (empty_chunks_at_end < chunk_space_reserved) {
+        uint64_t chunk_id = chunk_space_reserved - 1 - empty_chunks_at_end;
+        if (readHeaderPart(chunk_id) == MINUS_ONE) {
+            ++ empty_chunks_at_end;
+        } else {
+            break;
+        }
+    }
+    // If empty chunks were found, then shrink chunk reservation
+    if (empty_chunks_at_end) {
+        chunk_space_reserved -= empty_chunks_at_end;
+        if (options.cache_header_parts) {
+            header_parts.resize(chunk_space_reserved);
+        }
+        if (free_ids_loaded) {
+            free_ids.erase(free_ids.lower_bound(chunk_space_reserved), free_ids.end());
+        }
+        uint64_t data_area_move = empty_chunks_at_end * HEADERPART_SIZE;
+        uint64_t new_data_area_begin = HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE;
+        releaseSpace(new_data_area_begin, data_area_move);
+    }
+}
+
+bool Chunkfile::optimizeDataParts(uint64_t max_bytes_to_move)
+{
+    uint64_t bytes_moved = 0;
+    while (!free_spaces.empty()) {
+        // Get the first free space
+        uint64_t free_space_pos = free_spaces.begin()->first;
+        uint64_t free_space_size = free_spaces.begin()->second;
+        uint64_t next_pos = free_space_pos + free_space_size;
+        if (next_pos > file_size) {
+            throw CorruptedFile();
+        }
+
+        // If free space is at the end of file, then get rid of it
+        if (next_pos == file_size) {
+            removeFreeSpace(free_space_pos);
+            assert(total_data_part_empty_space >= free_space_size);
+            total_data_part_empty_space -= free_space_size;
+            file_size = free_space_pos;
+            truncateFile(file_size);
+            continue;
+        }
+
+        // Read the data part after the free space
+        readSeek(next_pos);
+        uint64_t next_size;
+        uint8_t next_type;
+        readUInt63AndUInt1(next_size, next_type);
+        if (next_size < DATAPART_FREESPACE_MIN_SIZE || next_pos + next_size > file_size) {
+            throw CorruptedFile();
+        }
+
+        // If there are two successive free spaces, then combine them
+        if (next_type == DATAPART_TYPE_FREESPACE) {
+            writeSeek(free_space_pos);
+            writeUInt63AndUInt1(free_space_size + next_size, DATAPART_TYPE_FREESPACE);
+            removeFreeSpace(next_pos);
+            removeFreeSpace(free_space_pos);
+            addFreeSpace(free_space_pos, free_space_size + next_size);
+            continue;
+        }
+
+        // There is data after the free space. Stop if enough has been done.
+        if (bytes_moved >= max_bytes_to_move) {
+            return false;
+        }
+        DataPartHeader header;
+        readDataPartHeader(header, next_pos);
+        if (header.size != next_size) {
+            throw CorruptedFile();
+        }
+        if (!(header.flags & FLAG_SHARED) && !hasSparseIds() && header.chunk_id >= chunk_space_reserved) {
+            throw CorruptedFile();
+        }
+
+        // Swap the data part and the free space
+        ++ stat_data_part_moves;
+        copyBytes(free_space_pos, next_pos, next_size);
+        uint64_t new_free_space_pos = free_space_pos + next_size;
+        writeSeek(new_free_space_pos);
+        writeUInt63AndUInt1(free_space_size, DATAPART_TYPE_FREESPACE);
+        removeFreeSpace(free_space_pos);
+        addFreeSpace(new_free_space_pos, free_space_size);
+        updateDataPartPosition(header, free_space_pos);
+
+        bytes_moved += next_size;
+    }
+    return true;
+}
+
+void Chunkfile::copyBytes(uint64_t dst_pos, uint64_t src_pos, uint64_t size)
+{
+    assert(dst_pos <= src_pos || dst_pos >= src_pos + size);
+    Bytes copy_buf(std::min<uint64_t>(size, COPY_BUF_SIZE));
+    for (uint64_t offset = 0; offset < size; offset += copy_buf.size()) {
+        uint64_t copy_size = std::min<uint64_t>(size - offset, copy_buf.size());
+        readSeek(src_pos + offset);
+        readBytes(&copy_buf[0], copy_size);
+        writeSeek(dst_pos + offset);
+        writeBytes(&copy_buf[0], copy_size);
+    }
+}
+
+uint8_t const* Chunkfile::mapFile()
+{
+    // Make sure all writes are visible in the memory map
+    if (options.write_ahead_log) {
+        sync();
+        if (!transaction_writes.empty() || transaction_truncate != MINUS_ONE) {
+            throw std::runtime_error("Views can not be used during a transaction!");
+        }
+    } else {
+        applyPendingWrites();
+    }
+
+    uint8_t const* map = backend->map(file_size);
+    if (!map) {
+        throw std::runtime_error("Backend does not support views!");
+    }
+    return map;
+}
+
+void Chunkfile::truncateFile(uint64_t new_size)
+{
+    if (options.write_ahead_log) {
+        assert(transaction_depth > 0);
+        transaction_truncate = std::min(transaction_truncate, new_size);
+        truncateWrites(transaction_writes, new_size);
+        return;
+    }
+    if (options.write_back_size > 0) {
+        pending_truncate = std::min(pending_truncate, new_size);
+        truncateWrites(pending_writes, new_size);
+        return;
+    }
+    backend->truncate(new_size);
+}
+
+void Chunkfile::extendFile(uint64_t new_size)
+{
+    assert(new_size > 0);
+    // Buffered writes need actual bytes, so write only
+    // the last one. Everything before it becomes a hole.
+    if (options.write_ahead_log || options.write_back_size > 0) {
+        uint8_t const zero = 0;
+        writeSeek(new_size - 1);
+        writeBytes(&zero, 1);
+        return;
+    }
+    backend->truncate(new_size);
+}
+
+void Chunkfile::begin()
+{
+    Lock lock(this, true);
+
+    if (options.write_ahead_log) {
+        if (transaction_failed) {
+            throw std::runtime_error("Transaction has failed!");
+        }
+        ++ transaction_depth;
+    }
+}
+
+void Chunkfile::commit()
+{
+    if (!options.write_ahead_log) {
+        return;
+    }
+    Lock lock(this, true);
+    if (transaction_depth == 0) {
+        throw std::runtime_error("There is no transaction to commit!");
+    }
+    -- transaction_depth;
+    if (transaction_depth > 0) {
+        return;
+    }
+    if (transaction_failed) {
+        transaction_failed = false;
+        throw std::runtime_error("Transaction has failed!");
+    }
+    if (transaction_writes.empty() && transaction_truncate == MINUS_ONE) {
+        return;
+    }
+
+    // Add transaction to the log buffer. It contains
+    // optional truncate, writes and checksum.
+    uint64_t transaction_begin = wal_buffer.size();
+    appendUInt64(wal_buffer, transaction_truncate);
+    appendUInt64(wal_buffer, transaction_writes.size());
+    for (Writes::const_iterator it = transaction_writes.begin(); it != transaction_writes.end(); ++ it) {
+        appendUInt64(wal_buffer, it->first);
+        appendUInt64(wal_buffer, it->second.size());
+        wal_buffer.insert(wal_buffer.end(), it->second.begin(), it->second.end());
+    }
+    appendUInt64(wal_buffer, calculateChecksum(&wal_buffer[transaction_begin], wal_buffer.size() - transaction_begin));
+
+    // Committed writes wait in pending writes until they are applied
+    if (transaction_truncate != MINUS_ONE) {
+        pending_truncate = std::min(pending_truncate, transaction_truncate);
+        truncateWrites(pending_writes, transaction_truncate);
+    }
+    for (Writes::const_iterator it = transaction_writes.begin(); it != transaction_writes.end(); ++ it) {
+        addWrite(pending_writes, it->first, &it->second[0], it->second.size());
+    }
+    transaction_writes.clear();
+    transaction_truncate = MINUS_ONE;
+
+    ++ wal_buffered_commits;
+    if (wal_buffered_commits >= options.group_commit_size) {
+        sync();
+    }
+}
+
+Chunkfile::Stats Chunkfile::getStats()
+{
+    Lock lock(this, false);
+
+    Stats stats;
+    stats.reads = stat_reads.load();
+    stats.writes = stat_writes.load();
+    stats.seeks = stat_seeks.load();
+    stats.bytes_read = stat_bytes_read.load();
+    stats.bytes_written = stat_bytes_written.load();
+    stats.bytes_set = stat_bytes_set;
+    stats.data_part_moves = stat_data_part_moves;
+    stats.reserve_growths = stat_reserve_growths;
+    stats.optimizations = stat_optimizations;
+    stats.bytes_deduplicated = stat_bytes_deduplicated;
+
+    stats.file_size = file_size;
+    stats.chunks = chunks;
+    stats.chunk_space_reserved = chunk_space_reserved;
+    uint64_t data_area_size = file_size - std::min<uint64_t>(file_size, HEADER_SIZE + chunk_space_reserved * HEADERPART_SIZE);
+    stats.empty_space = total_data_part_empty_space;
+    stats.live_bytes = data_area_size - total_data_part_empty_space;
+    stats.fragmentation = data_area_size > 0 ? double(total_data_part_empty_space) / data_area_size : 0;
+    stats.write_amplification = stat_bytes_set > 0 ? double(stats.bytes_written) / stat_bytes_set : 0;
+    return stats;
+}
+
+void Chunkfile::flush()
+{
+    Lock lock(this, true);
+
+    if (options.write_ahead_log) {
+        sync();
+        return;
+    }
+    applyPendingWrites();
+}
+
+void Chunkfile::sync()
+{
+    Lock lock(this, true);
+
+    if (!options.write_ahead_log) {
+        applyPendingWrites();
+        backend->sync();
+        return;
+    }
+    writeWriteAheadLog();
+    applyPendingWrites();
+}
+
+void Chunkfile::rollback()
+{
+    transaction_writes.clear();
+    transaction_truncate = MINUS_ONE;
+
+    // When all committed writes are in the file, the
+    // state of the file can be loaded from it again.
+    sync();
+    file_size = getFileSize();
+    applied_file_size = file_size;
+    readHeader();
+}
+
+void Chunkfile::recoverWriteAheadLog()
+{
+    int log_fd = ::open(wal_path.c_str(), O_RDONLY);
+    if (log_fd < 0) {
+        return;
+    }
+
+    // Read the whole log
+    Bytes log;
+    uint8_t read_buf[COPY_BUF_SIZE];
+    ssize_t read_size;
+    while ((read_size = ::read(log_fd, read_buf, sizeof(read_buf))) > 0) {
+        log.insert(log.end(), read_buf, read_buf + read_size);
+    }
+    ::close(log_fd);
+    if (read_size < 0) {
+        throw std::runtime_error("Unable to read write ahead log!");
+    }
+
+    // Redo all complete transactions. The last one might be
+    // incomplete, if program crashed while it was written.
+    uint64_t log_pos = 0;
+    while (log_pos + 24 <= log.size()) {
+        uint64_t transaction_begin = log_pos;
+        uint64_t truncate = decodeUInt64(&log[log_pos]);
+        uint64_t writes_count = decodeUInt64(&log[log_pos + 8]);
+        log_pos += 16;
+        Writes writes;
+        bool complete = true;
+        for (uint64_t i = 0; i < writes_count; ++ i) {
+            if (log_pos + 16 > log.size()) {
+                complete = false;
+                break;
+            }
+            uint64_t write_pos = decodeUInt64(&log[log_pos]);
+            uint64_t write_size = decodeUInt64(&log[log_pos + 8]);
+            log_pos += 16;
+            if (write_size > log.size() - log_pos) {
+                complete = false;
+                break;
+            }
+            writes[write_pos].assign(log.begin() + log_pos, log.begin() + log_pos + write_size);
+            log_pos += write_size;
+        }
+        if (!complete || log_pos + 8 > log.size()) {
+            break;
+        }
+        if (decodeUInt64(&log[log_pos]) != calculateChecksum(&log[transaction_begin], log_pos - transaction_begin)) {
+            break;
+        }
+        log_pos += 8;
+
+        if (truncate != MINUS_ONE) {
+            backend->truncate(truncate);
+        }
+        for (Writes::const_iterator it = writes.begin(); it != writes.end(); ++ it) {
+            writeToBackend(it->first, &it->second[0], it->second.size());
+        }
+    }
+
+    // Make sure the file is on disk before the log is removed
+    backend->sync();
+    ::unlink(wal_path.c_str());
+}
+
+void Chunkfile::writeWriteAheadLog()
+{
+    if (wal_buffer.empty()) {
+        return;
+    }
+    uint64_t written = 0;
+    while (written < wal_buffer.size()) {
+        ssize_t write_size = ::write(wal_fd, &wal_buffer[written], wal_buffer.size() - written);
+        if (write_size < 0) {
+            throw std::runtime_error("Unable to write write ahead log!");
+        }
+        written += write_size;
+        stat_writes.fetch_add(1, std::memory_order_relaxed);
+    }
+    stat_bytes_written.fetch_add(wal_buffer.size(), std::memory_order_relaxed);
+    if (::fsync(wal_fd) != 0) {
+        throw std::runtime_error("Unable to sync write ahead log!");
+    }
+    wal_size += wal_buffer.size();
+    wal_buffer.clear();
+    wal_buffered_commits = 0;
+}
+
+void Chunkfile::applyPendingWrites()
+{
+    // Nothing should be applied before it is safely in the log
+    assert(wal_buffer.empty());
+
+    if (pending_truncate != MINUS_ONE) {
+        backend->truncate(pending_truncate);
+        applied_file_size = std::min(applied_file_size, pending_truncate);
+        pending_truncate = MINUS_ONE;
+    }
+    for (Writes::const_iterator it = pending_writes.begin(); it != pending_writes.end(); ++ it) {
+        writeToBackend(it->first, &it->second[0], it->second.size());
+        applied_file_size = std::max<uint64_t>(applied_file_size, it->first + it->second.size());
+    }
+    pending_writes.clear();
+    pending_writes_size = 0;
+
+    // If log has grown too big, then make sure the file
+    // is on disk, so the log is not needed anymore.
+    if (wal_size >= WAL_CHECKPOINT_SIZE) {
+        backend->sync();
+        if (::ftruncate(wal_fd, 0) != 0) {
+            throw std::runtime_error("Unable to truncate write ahead log!");
+        }
+        wal_size = 0;
+    }
+}
+
+void Chunkfile::readBytesWithPendingWrites(uint64_t pos, uint8_t* result, uint64_t size)
+{
+    // Read the part that is in the actual file
+    if (pos < applied_file_size) {
+        uint64_t size_from_file = std::min(size, applied_file_size - pos);
+        readFromBackend(result, pos, size_from_file);
+    }
+    if (pos + size > file_size) {
+        throw CorruptedFile();
+    }
+    // Then replace it with pending writes, and the writes of
+    // ongoing transaction, which are not yet in pending writes.
+    readWrites(pending_writes, pos, result, size);
+    readWrites(transaction_writes, pos, result, size);
+}
+
+Chunkfile::Backend* Chunkfile::createBackend(std::string const& path, Options const& options)
+{
+    switch (options.backend) {
+    case Options::BACKEND_POSIX:
+        return new PosixBackend(path);
+    case Options::BACKEND_FSTREAM:
+        return new FstreamBackend(path);
+    case Options::BACKEND_MEMORY:
+        return new MemoryBackend();
+    case Options::BACKEND_MMAP:
+        return new MmapBackend(path);
+    }
+    throw std::runtime_error("Unknown backend!");
+}
+
+Chunkfile::PosixBackend::PosixBackend(std::string const& path) :
+    mapped(NULL),
+    mapped_size(0)
+{
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Unable to open file!");
+    }
+}
+
+Chunkfile::PosixBackend::~PosixBackend()
+{
+    if (mapped) {
+        ::munmap(mapped, mapped_size);
+    }
+    ::close(fd);
+}
+
+uint64_t Chunkfile::PosixBackend::getSize()
+{
+    struct stat file_stat;
+    if (::fstat(fd, &file_stat) != 0) {
+        throw std::runtime_error("Unable to get file size!");
+    }
+    return file_stat.st_size;
+}
+
+void Chunkfile::PosixBackend::read(uint8_t* result, uint64_t pos, uint64_t size)
+{
+    while (size > 0) {
+        ssize_t read_size = ::pread(fd, result, size, pos);
+        if (read_size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Unable to read file!");
+        }
+        if (read_size == 0) {
+            throw CorruptedFile();
+        }
+        result += read_size;
+        pos += read_size;
+        size -= read_size;
+    }
+}
+
+void Chunkfile::PosixBackend::write(uint64_t pos, uint8_t const* bytes, uint64_t size)
+{
+    while (size > 0) {
+        ssize_t write_size = ::pwrite(fd, bytes, size, pos);
+        if (write_size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Unable to write file!");
+        }
+        bytes += write_size;
+        pos += write_size;
+        size -= write_size;
+    }
+}
+
+void Chunkfile::PosixBackend::truncate(uint64_t size)
+{
+    if (::ftruncate(fd, size) != 0) {
+        throw std::runtime_error("Unable to truncate file!");
+    }
+}
+
+void Chunkfile::PosixBackend::punchHole(uint64_t pos, uint64_t size)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // This is only an optimization, so errors are ignored. For
+    // example, many file systems do not support punching holes.
+    ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, size);
+#else
+    (void)pos;
+    (void)size;
+#endif
+}
+
+void Chunkfile::PosixBackend::sync()
+{
+    if (::fsync(fd) != 0) {
+        throw std::runtime_error("Unable to sync file!");
+    }
+}
+
+uint8_t const* Chunkfile::PosixBackend::map(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(map_mutex);
+    if (mapped && mapped_size >= size) {
+        return mapped;
+    }
+    if (mapped) {
+        ::munmap(mapped, mapped_size);
+        mapped = NULL;
+        mapped_size = 0;
+    }
+    if (size == 0) {
+        return NULL;
+    }
+    void* new_mapped = ::mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (new_mapped == MAP_FAILED) {
+        throw std::runtime_error("Unable to memory map file!");
+    }
+    mapped = (uint8_t*)new_mapped;
+    mapped_size = size;
+    return mapped;
+}
+
+Chunkfile::MmapBackend::MmapBackend(std::string const& path) :
+    PosixBackend(path),
+    data_size(PosixBackend::getSize())
+{
+    remap(data_size);
+}
+
+uint64_t Chunkfile::MmapBackend::getSize()
+{
+    return data_size;
+}
+
+void Chunkfile::MmapBackend::read(uint8_t* result, uint64_t pos, uint64_t size)
+{
+    if (pos + size > data_size) {
+        throw CorruptedFile();
+    }
+    if (size == 0) {
+        return;
+    }
+    std::memcpy(result, mapped + pos, size);
+}
+
+void Chunkfile::MmapBackend::write(uint64_t pos, uint8_t const* bytes, uint64_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    if (pos + size > data_size) {
+        truncate(pos + size);
+    }
+    std::memcpy(mapped + pos, bytes, size);
+}
+
+void Chunkfile::MmapBackend::truncate(uint64_t size)
+{
+    PosixBackend::truncate(size);
+    data_size = size;
+    if (size > mapped_size) {
+        remap(size);
+    }
+}
+
+void Chunkfile::MmapBackend::sync()
+{
+    if (mapped && ::msync(mapped, data_size, MS_SYNC) != 0) {
+        throw std::runtime_error("Unable to sync file!");
+    }
+    PosixBackend::sync();
+}
+
+uint8_t const* Chunkfile::MmapBackend::map(uint64_t size)
+{
+    if (size == 0 || size > data_size) {
+        return NULL;
+    }
+    return mapped;
+}
+
+void Chunkfile::MmapBackend::remap(uint64_t min_size)
+{
+    if (mapped) {
+        ::munmap(mapped, mapped_size);
+        mapped = NULL;
+        mapped_size = 0;
+    }
+    // Mapping grows in powers of two. Pages past the end of file
+    // are never touched, so they do not need to exist yet.
+    uint64_t new_mapping_size = MIN_MAPPING_SIZE;
+    while (new_mapping_size < min_size) {
+        new_mapping_size *= 2;
+    }
+    void* new_data = ::mmap(NULL, new_mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (new_data == MAP_FAILED) {
+        throw std::runtime_error("Unable to memory map file!");
+    }
+    mapped = (uint8_t*)new_data;
+    mapped_size = new_mapping_size;
+}
+
+Chunkfile::FstreamBackend::FstreamBackend(std::string const& path) :
+    path(path)
+{
+    // Make sure the file exists
+// TODO: This is needed because std::ios::app and .seekp() does not work together. And if std::ios::app is not used, then file is not created. Find more elegant way of doing this!
+    file.open(path, std::ios::binary | std::ios::out | std::ios::app);
+    file.close();
+
+    // Open
+    file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!file.is_open()) {
+        throw std::runtime_error("Unable to open file!");
+    }
+}
+
+uint64_t Chunkfile::FstreamBackend::getSize()
+{
+    std::lock_guard<std::mutex> lock(file_mutex);
+    file.seekg(0, std::ios::end);
+    return file.tellg();
+}
+
+void Chunkfile::FstreamBackend::read(uint8_t* result, uint64_t pos, uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(file_mutex);
+    file.seekg(pos);
+    file.read((char*)result, size);
+    if (!file) {
+        file.clear();
+        throw CorruptedFile();
+    }
+}
+
+void Chunkfile::FstreamBackend::write(uint64_t pos, uint8_t const* bytes, uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(file_mutex);
+    file.seekp(pos);
+    file.write((char const*)bytes, size);
+    if (!file) {
+        file.clear();
+        throw std::runtime_error("Unable to write file!");
+    }
+}
+
+void Chunkfile::FstreamBackend::truncate(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(file_mutex);
+    file.flush();
+    if (::truncate(path.c_str(), size) != 0) {
+        throw std::runtime_error("Unable to truncate file!");
+    }
+}
+
+void Chunkfile::FstreamBackend::sync()
+{
+    // Standard streams can not sync to disk, so just flush
+    std::lock_guard<std::mutex> lock(file_mutex);
+    file.flush();
+}
+
+uint64_t Chunkfile::MemoryBackend::getSize()
+{
+    return data.size();
+}
+
+void Chunkfile::MemoryBackend::read(uint8_t* result, uint64_t pos, uint64_t size)
+{
+    if (pos + size > data.size()) {
+        throw CorruptedFile();
+    }
+    std::copy(data.begin() + pos, data.begin() + pos + size, result);
+}
+
+void Chunkfile::MemoryBackend::write(uint64_t pos, uint8_t const* bytes, uint64_t size)
+{
+    if (pos + size > data.size()) {
+        data.resize(pos + size);
+    }
+    std::copy(bytes, bytes + size, data.begin() + pos);
+}
+
+void Chunkfile::MemoryBackend::truncate(uint64_t size)
+{
+    data.resize(size);
+}
+
+void Chunkfile::MemoryBackend::sync()
+{
+}
+
+uint8_t const* Chunkfile::MemoryBackend::map(uint64_t size)
+{
+    if (size == 0 || data.size() < size) {
+        return NULL;
+    }
+    return &data[0];
+}
+
+void Chunkfile::addWrite(Writes& writes, uint64_t pos, uint8_t const* bytes, uint64_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    uint64_t end = pos + size;
+
+    // Find the first write that touches the new one
+    Writes::iterator it = writes.upper_bound(pos);
+    if (it != writes.begin()) {
+        Writes::iterator prev = it;
+        -- prev;
+        if (prev->first + prev->second.size() >= pos) {
+            it = prev;
+        }
+    }
+
+    // Merge to it, if it begins before the new write. Otherwise create new.
+    Writes::iterator target;
+    if (it != writes.end() && it->first <= pos) {
+        target = it;
+        ++ it;
+    } else {
+        target = writes.insert(it, std::make_pair(pos, Bytes()));
+    }
+
+    // Merge all following writes that touch the new one
+    uint64_t merged_end = std::max<uint64_t>(end, target->first + target->second.size());
+    for (Writes::const_iterator it2 = it; it2 != writes.end() && it2->first <= end; ++ it2) {
+        merged_end = std::max<uint64_t>(merged_end, it2->first + it2->second.size());
+    }
+    Bytes& target_bytes = target->second;
+    target_bytes.resize(merged_end - target->first);
+    while (it != writes.end() && it->first <= end) {
+        uint64_t it_end = it->first + it->second.size();
+        if (it_end > end) {
+            std::copy(it->second.begin() + (end - it->first), it->second.end(), target_bytes.begin() + (end - target->first));
+        }
+        writes.erase(it ++);
+    }
+    std::copy(bytes, bytes + size, target_bytes.begin() + (pos - target->first));
+}
+
+void Chunkfile::readWrites(Writes const& writes, uint64_t pos, uint8_t* result, uint64_t size)
+{
+    Writes::const_iterator it = writes.upper_bound(pos);
+    if (it != writes.begin()) {
+        -- it;
+    }
+    for (; it != writes.end() && it->first < pos + size; ++ it) {
+        uint64_t begin = std::max<uint64_t>(pos, it->first);
+        uint64_t end = std::min<uint64_t>(pos + size, it->first + it->second.size());
+        if (begin < end) {
+            std::copy(it->second.begin() + (begin - it->first), it->second.begin() + (end - it->first), result + (begin - pos));
+        }
+    }
+}
+
+void Chunkfile::truncateWrites(Writes& writes, uint64_t size)
+{
+    Writes::iterator it = writes.lower_bound(size);
+    writes.erase(it, writes.end());
+    if (!writes.empty()) {
+        Writes::iterator last = -- writes.end();
+        if (last->first + last->second.size() > size) {
+            last->second.resize(size - last->first);
+        }
+    }
+}
+
+uint64_t Chunkfile::calculateChecksum(uint8_t const* bytes, uint64_t size)
+{
+    // FNV-1a
+    uint64_t checksum = 0xcbf29ce484222325;
+    for (uint64_t i = 0; i < size; ++ i) {
+        checksum ^= bytes[i];
+        checksum *= 0x100000001b3;
+    }
+    return checksum;
+}
+
+#ifdef CHUNKFILE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t calculateCrc32cSse42(uint8_t const* bytes, uint64_t size, uint32_t crc)
+{
+    uint64_t crc64 = crc;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; size > 0; ++ bytes, -- size) {
+        crc = _mm_crc32_u8(crc, *bytes);
+    }
+    return crc;
+}
+#endif
+
+// Tables for calculating eight bytes at a time
+struct Crc32cTables
+{
+    uint32_t tables[8][256];
+
+    Crc32cTables()
+    {
+        for (unsigned i = 0; i < 256; ++ i) {
+            uint32_t crc = i;
+            for (unsigned bit = 0; bit < 8; ++ bit) {
+                crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+            }
+            tables[0][i] = crc;
+        }
+        for (unsigned i = 0; i < 256; ++ i) {
+            for (unsigned table = 1; table < 8; ++ table) {
+                tables[table][i] = (tables[table - 1][i] >> 8) ^ tables[0][tables[table - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+uint32_t Chunkfile::calculateCrc32c(uint8_t const* bytes, uint64_t size, uint32_t crc)
+{
+    crc = ~crc;
+#ifdef CHUNKFILE_SSE42
+    static bool const has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) {
+        return ~calculateCrc32cSse42(bytes, size, crc);
+    }
+#endif
+    static Crc32cTables const crc32c_tables;
+    uint32_t const (&tables)[8][256] = crc32c_tables.tables;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        crc ^= decodeUInt32(bytes);
+        uint32_t high = decodeUInt32(bytes + 4);
+        crc = tables[7][crc & 0xff] ^ tables[6][(crc >> 8) & 0xff] ^ tables[5][(crc >> 16) & 0xff] ^ tables[4][crc >> 24] ^
+              tables[3][high & 0xff] ^ tables[2][(high >> 8) & 0xff] ^ tables[1][(high >> 16) & 0xff] ^ tables[0][high >> 24];
+    }
+    for (; size > 0; ++ bytes, -- size) {
+        crc = (crc >> 8) ^ tables[0][(crc ^ *bytes) & 0xff];
+    }
+    return ~crc;
+}
+
+// Makes sure that the contents of a file, or the
+// entries of a directory, are stored on disk
+static void syncPath(std::string const& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Unable to open file for syncing!");
+    }
+    int result = ::fsync(fd);
+    ::close(fd);
+    if (result != 0) {
+        throw std::runtime_error("Unable to sync file!");
+    }
+}
+
+ShardedChunkfile::ShardedChunkfile(std::string const& path, Options const& options) :
+    options(options)
+{
+    // Checked before anything is written, so that
+    // invalid options never end up in the directory
+    if (options.shards == 0) {
+        throw std::runtime_error("There must be at least one shard!");
+    }
+    if (options.partitioning == Options::PARTITION_RANGE && options.range_size == 0) {
+        throw std::runtime_error("Range size must not be zero!");
+    }
+    if (options.chunkfile.backend != Chunkfile::Options::BACKEND_MEMORY) {
+        loadConfiguration(path);
+    }
+
+    try {
+        for (unsigned index = 0; index < this->options.shards; ++ index) {
+            shards.push_back(new Chunkfile(path + "/shard" + std::to_string(index), options.chunkfile));
+        }
+    }
+    catch ( ... ) {
+        for (Chunkfile* shard : shards) {
+            delete shard;
+        }
+        throw;
+    }
+}
+
+ShardedChunkfile::~ShardedChunkfile()
+{
+    for (Chunkfile* shard : shards) {
+        delete shard;
+    }
+}
+
+unsigned ShardedChunkfile::getShardCount() const
+{
+    return shards.size();
+}
+
+unsigned ShardedChunkfile::getShardIndex(uint64_t chunk_id) const
+{
+    if (options.partitioning == Options::PARTITION_RANGE) {
+        return std::min<uint64_t>(chunk_id / options.range_size, shards.size() - 1);
+    }
+    // Multiplicative hashing. It is different from the hash
+    // of sparse IDs, so that shards do not get clustered.
+    uint64_t hash = (chunk_id * 0x9e3779b97f4a7c15ULL) >> 32;
+    return (hash * shards.size()) >> 32;
+}
+
+Chunkfile& ShardedChunkfile::getShard(unsigned index)
+{
+    return *shards.at(index);
+}
+
+bool ShardedChunkfile::exists(uint64_t chunk_id)
+{
+    return shards[getShardIndex(chunk_id)]->exists(chunk_id);
+}
+
+void ShardedChunkfile::set(uint64_t chunk_id, uint8_t const* bytes, uint64_t size)
+{
+    shards[getShardIndex(chunk_id)]->set(chunk_id, bytes, size);
+}
+
+void ShardedChunkfile::write(uint64_t chunk_id, uint64_t offset, uint8_t const* bytes, uint64_t size)
+{
+    shards[getShardIndex(chunk_id)]->write(chunk_id, offset, bytes, size);
+}
+
+void ShardedChunkfile::append(uint64_t chunk_id, uint8_t const* bytes, uint64_t size)
+{
+    shards[getShardIndex(chunk_id)]->append(chunk_id, bytes, size);
+}
+
+uint64_t ShardedChunkfile::getChunkSize(uint64_t chunk_id)
+{
+    return shards[getShardIndex(chunk_id)]->getChunkSize(chunk_id);
+}
+
+void ShardedChunkfile::get(Bytes& result, uint64_t chunk_id)
+{
+    shards[getShardIndex(chunk_id)]->get(result, chunk_id);
+}
+
+void ShardedChunkfile::get(std::string& result, uint64_t chunk_id)
+{
+    shards[getShardIndex(chunk_id)]->get(result, chunk_id);
+}
+
+uint64_t ShardedChunkfile::read(uint8_t* result, uint64_t chunk_id, uint64_t offset, uint64_t size)
+{
+    return shards[getShardIndex(chunk_id)]->read(result, chunk_id, offset, size);
+}
+
+Chunkfile::Reader ShardedChunkfile::getReader(uint64_t chunk_id, uint64_t buffer_size)
+{
+    return shards[getShardIndex(chunk_id)]->getReader(chunk_id, buffer_size);
+}
+
+Chunkfile::View ShardedChunkfile::getView(uint64_t chunk_id)
+{
+    return shards[getShardIndex(chunk_id)]->getView(chunk_id);
+}
+
+void ShardedChunkfile::del(uint64_t chunk_id)
+{
+    shards[getShardIndex(chunk_id)]->del(chunk_id);
+}
+
+void ShardedChunkfile::getMany(std::vector<Bytes>& results, std::vector<uint64_t> const& chunk_ids)
+{
+    // Split chunks to shards, and remember where their results go
+    std::vector<std::vector<uint64_t> > shard_chunk_ids(shards.size());
+    std::vector<std::vector<size_t> > shard_indices(shards.size());
+    std::vector<bool> marked(shards.size(), false);
+    for (size_t i = 0; i < chunk_ids.size(); ++ i) {
+        unsigned index = getShardIndex(chunk_ids[i]);
+        shard_chunk_ids[index].push_back(chunk_ids[i]);
+        shard_indices[index].push_back(i);
+        marked[index] = true;
+    }
+
+    std::vector<std::vector<Bytes> > shard_results(shards.size());
+    runInShards(marked, [&](unsigned index) {
+        shards[index]->getMany(shard_results[index], shard_chunk_ids[index]);
+    });
+
+    results.resize(chunk_ids.size());
+    for (unsigned index = 0; index < shards.size(); ++ index) {
+        for (size_t i = 0; i < shard_indices[index].size(); ++ i) {
+            results[shard_indices[index][i]].swap(shard_results[index][i]);
+        }
+    }
+}
+
+void ShardedChunkfile::setMany(std::vector<uint64_t> const& chunk_ids, std::vector<Bytes> const& values)
+{
+    if (chunk_ids.size() != values.size()) {
+        throw std::runtime_error("Number of chunk IDs and values differ!");
+    }
+
+    // The order of chunks is kept, so the last one of the same chunk
+    // ID is still used. Values are not copied, only pointed to.
+    std::vector<std::vector<uint64_t> > shard_chunk_ids(shards.size());
+    std::vector<std::vector<Bytes const*> > shard_values(shards.size());
+    std::vector<bool> marked(shards.size(), false);
+    for (size_t i = 0; i < chunk_ids.size(); ++ i) {
+        unsigned index = getShardIndex(chunk_ids[i]);
+        shard_chunk_ids[index].push_back(chunk_ids[i]);
+        shard_values[index].push_back(&values[i]);
+        marked[index] = true;
+    }
+
+    runInShards(marked, [&](unsigned index) {
+        shards[index]->setMany(shard_chunk_ids[index], shard_values[index]);
+    });
+}
+
+void ShardedChunkfile::delMany(std::vector<uint64_t> const& chunk_ids)
+{
+    std::vector<std::vector<uint64_t> > shard_chunk_ids(shards.size());
+    std::vector<bool> marked(shards.size(), false);
+    for (size_t i = 0; i < chunk_ids.size(); ++ i) {
+        unsigned index = getShardIndex(chunk_ids[i]);
+        shard_chunk_ids[index].push_back(chunk_ids[i]);
+        marked[index] = true;
+    }
+
+    // All shards are checked before any of them removes
+    // anything, so a missing chunk leaves every shard as it is
+    runInShards(marked, [&](unsigned index) {
+        for (uint64_t chunk_id : shard_chunk_ids[index]) {
+            if (!shards[index]->exists(chunk_id)) {
+                throw Chunkfile::ChunkDoesNotExist();
+            }
+        }
+    });
+    runInShards(marked, [&](unsigned index) {
+        shards[index]->delMany(shard_chunk_ids[index]);
+    });
+}
+
+void ShardedChunkfile::verify(bool check_contents, unsigned threads)
+{
+    if (threads == 0) {
+        threads = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+    }
+    unsigned shard_threads = std::max<unsigned>(threads / shards.size(), 1);
+    runInShards(std::vector<bool>(shards.size(), true), [&](unsigned index) {
+        shards[index]->verify(check_contents, shard_threads);
+    });
+}
+
+void ShardedChunkfile::optimize()
+{
+    runInShards(std::vector<bool>(shards.size(), true), [&](unsigned index) {
+        shards[index]->optimize();
+    });
+}
+
+void ShardedChunkfile::flush()
+{
+    runInShards(std::vector<bool>(shards.size(), true), [&](unsigned index) {
+        shards[index]->flush();
+    });
+}
+
+void ShardedChunkfile::sync()
+{
+    runInShards(std::vector<bool>(shards.size(), true), [&](unsigned index) {
+        shards[index]->sync();
+    });
+}
+
+Chunkfile::Stats ShardedChunkfile::getStats()
+{
+    Chunkfile::Stats stats = shards[0]->getStats();
+    for (unsigned index = 1; index < shards.size(); ++ index) {
+        Chunkfile::Stats shard_stats = shards[index]->getStats();
+        stats.reads += shard_stats.reads;
+        stats.writes += shard_stats.writes;
+        stats.seeks += shard_stats.seeks;
+        stats.bytes_read += shard_stats.bytes_read;
+        stats.bytes_written += shard_stats.bytes_written;
+        stats.bytes_set += shard_stats.bytes_set;
+        stats.data_part_moves += shard_stats.data_part_moves;
+        stats.reserve_growths += shard_stats.reserve_growths;
+        stats.optimizations += shard_stats.optimizations;
+        stats.bytes_deduplicated += shard_stats.bytes_deduplicated;
+        stats.file_size += shard_stats.file_size;
+        stats.chunks += shard_stats.chunks;
+        stats.chunk_space_reserved += shard_stats.chunk_space_reserved;
+        stats.live_bytes += shard_stats.live_bytes;
+        stats.empty_space += shard_stats.empty_space;
+    }
+    uint64_t data_area_size = stats.live_bytes + stats.empty_space;
+    stats.fragmentation = data_area_size > 0 ? double(stats.empty_space) / data_area_size : 0;
+    stats.write_amplification = stats.bytes_set > 0 ? double(stats.bytes_written) / stats.bytes_set : 0;
+    return stats;
+}
+
+void ShardedChunkfile::loadConfiguration(std::string const& path)
+{
+    if (::mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+        throw std::runtime_error("Unable to create directory!");
+    }
+
+    std::string configuration_path = path + "/shards";
+    std::ifstream in(configuration_path.c_str());
+    if (in) {
+        // Existing directory
+        std::string magic;
+        unsigned partitioning;
+        in >> magic >> options.shards >> partitioning >> options.range_size;
+        if (!in || magic != "CHUNKFILESHARDS" || partitioning > Options::PARTITION_RANGE || options.shards == 0) {
+            throw Chunkfile::CorruptedFile();
+        }
+        if (partitioning == Options::PARTITION_RANGE && options.range_size == 0) {
+            throw Chunkfile::CorruptedFile();
+        }
+        options.partitioning = Options::Partitioning(partitioning);
+        return;
+    }
+
+    // New directory. The configuration is written to a temporary file
+    // first, so a crash can not leave an incomplete one behind. It is
+    // synced before it is renamed, and the directory after it, so that
+    // the rename can not be stored before the contents.
+    std::string tmp_path = configuration_path + ".tmp";
+    std::ofstream out(tmp_path.c_str(), std::ios::trunc);
+    out << "CHUNKFILESHARDS " << options.shards << " " << unsigned(options.partitioning) << " " << options.range_size << "\n";
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Unable to write shard configuration!");
+    }
+    syncPath(tmp_path);
+    if (::rename(tmp_path.c_str(), configuration_path.c_str()) < 0) {
+        throw std::runtime_error("Unable to write shard configuration!");
+    }
+    syncPath(path);
+}
+
+void ShardedChunkfile::runInShards(std::vector<bool> const& marked, std::function<void(unsigned)> const& run)
+{
+    std::vector<unsigned> indices;
+    for (unsigned index = 0; index < marked.size(); ++ index) {
+        if (marked[index]) {
+            indices.push_back(index);
+        }
+    }
+
+    // The first shard is run by this thread
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(indices.size());
+    for (size_t i = 1; i < indices.size(); ++ i) {
+        threads.push_back(std::thread([&run, &indices, &errors, i]() {
+            try {
+                run(indices[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }));
+    }
+    try {
+        if (!indices.empty()) {
+            run(indices[0]);
+        }
+    } catch (...) {
+        errors[0] = std::current_exception();
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (size_t i = 0; i < errors.size(); ++ i) {
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+    }
 }
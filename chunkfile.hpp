@@ -1,16 +1,31 @@
 #ifndef CHUNKFILE_HPP
 #define CHUNKFILE_HPP
 
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <set>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 // Two file library (only .cpp and .hpp files are needed) that represents file
 // as a vector of Chunks. Chunks are arrays of bytes. They are identified by
 // their index number. Index number can also point to chunk that does not exist.
+//
+// Reading functions (exists(), getChunkSize(), get() and friends, read(),
+// getView() and getMany()) can be called from multiple threads at the same
+// time. All other functions lock the whole Chunkfile while they run.
 class Chunkfile
 {
 
@@ -36,9 +51,241 @@ public:
 
     typedef std::vector<uint8_t> Bytes;
 
-    Chunkfile(std::string const& path);
+    // Storage of the actual file. Reads and writes are positional,
+    // so backends do not need to keep track of any cursor. read() and
+    // map() must be safe to call from multiple threads at the same time.
+    class Backend
+    {
+    public:
+        inline virtual ~Backend() {}
+
+        virtual uint64_t getSize() = 0;
+
+        // Throws CorruptedFile if reading past the end
+        virtual void read(uint8_t* result, uint64_t pos, uint64_t size) = 0;
+
+        virtual void write(uint64_t pos, uint8_t const* bytes, uint64_t size) = 0;
+
+        // Sets the size of the file. If the file grows,
+        // the new bytes do not need to be initialized.
+        virtual void truncate(uint64_t size) = 0;
+
+        // Tells that the contents of the area are not needed anymore, so
+        // backend can release the disk space. Size of file stays the same.
+        inline virtual void punchHole(uint64_t pos, uint64_t size)
+        {
+            (void)pos;
+            (void)size;
+        }
+
+        // Makes sure everything is written to disk
+        virtual void sync() = 0;
+
+        // Returns read only memory that contains the whole file, or NULL if
+        // this is not supported. Memory is valid until the file is modified.
+        inline virtual uint8_t const* map(uint64_t size)
+        {
+            (void)size;
+            return NULL;
+        }
+    };
+
+    // Default backend. Uses pread() and pwrite().
+    class PosixBackend : public Backend
+    {
+    public:
+        PosixBackend(std::string const& path);
+        ~PosixBackend();
+        uint64_t getSize();
+        void read(uint8_t* result, uint64_t pos, uint64_t size);
+        void write(uint64_t pos, uint8_t const* bytes, uint64_t size);
+        void truncate(uint64_t size);
+        void punchHole(uint64_t pos, uint64_t size);
+        void sync();
+        uint8_t const* map(uint64_t size);
+    protected:
+        int fd;
+        uint8_t* mapped;
+        uint64_t mapped_size;
+    private:
+        std::mutex map_mutex;
+    };
+
+    // Maps the whole file to memory for reading and writing, so reads and
+    // writes are only copying of memory. File is truncated when it grows,
+    // and the mapping is replaced with a bigger one when needed, so views
+    // become invalid then. Syncing flushes the mapping to disk.
+    class MmapBackend : public PosixBackend
+    {
+    public:
+        MmapBackend(std::string const& path);
+        uint64_t getSize();
+        void read(uint8_t* result, uint64_t pos, uint64_t size);
+        void write(uint64_t pos, uint8_t const* bytes, uint64_t size);
+        void truncate(uint64_t size);
+        void sync();
+        uint8_t const* map(uint64_t size);
+    private:
+        // Mapping is bigger than the file, so it does
+        // not need to be replaced every time file grows.
+        static uint64_t const MIN_MAPPING_SIZE = 1024 * 1024;
+
+        // The mapping itself is stored in "mapped" and "mapped_size".
+        // It is only replaced when writing, so it needs no mutex.
+        uint64_t data_size;
+
+        void remap(uint64_t min_size);
+    };
+
+    // The original file access with std::fstream, kept for comparison. All
+    // reads go through one stream under a mutex, and sync() only flushes it,
+    // so nothing is guaranteed to be on disk. Truncating still uses POSIX.
+    class FstreamBackend : public Backend
+    {
+    public:
+        FstreamBackend(std::string const& path);
+        uint64_t getSize();
+        void read(uint8_t* result, uint64_t pos, uint64_t size);
+        void write(uint64_t pos, uint8_t const* bytes, uint64_t size);
+        void truncate(uint64_t size);
+        void sync();
+    private:
+        std::string path;
+        std::mutex file_mutex;
+        std::fstream file;
+    };
+
+    // Keeps the whole file in memory. Mostly useful for testing.
+    class MemoryBackend : public Backend
+    {
+    public:
+        uint64_t getSize();
+        void read(uint8_t* result, uint64_t pos, uint64_t size);
+        void write(uint64_t pos, uint8_t const* bytes, uint64_t size);
+        void truncate(uint64_t size);
+        void sync();
+        uint8_t const* map(uint64_t size);
+    private:
+        Bytes data;
+    };
+
+    struct Options
+    {
+        // Keeps all header parts in memory. They are read at once when the
+        // file is opened, so finding chunks needs no reading from the file.
+        // Changes are still written to the file immediately. Needs 8 bytes
+        // of memory per every reserved chunk.
+        bool cache_header_parts;
+
+        // Writes all changes first to a redo log next to the file (path
+        // with ".wal" appended). Every modification, or every group of
+        // modifications between begin() and commit(), is then applied to
+        // the file completely or not at all, even if the program crashes.
+        bool write_ahead_log;
+
+        // How many committed transactions are collected before they are
+        // written to the log with a single sync to disk. Until then, the
+        // latest commits may be lost in a crash, but the file stays
+        // consistent. sync() and destructor write the log immediately.
+        unsigned group_commit_size;
+
+        // Which backend is used for accessing the file. With memory backend,
+        // path is not used and nothing is stored. Mmap backend reads and
+        // writes through a memory mapping, which avoids a system call per
+        // read and write. Write ahead log can only be used with a path to
+        // an actual file.
+        enum BackendType
+        {
+            BACKEND_POSIX,
+            BACKEND_FSTREAM,
+            BACKEND_MEMORY,
+            BACKEND_MMAP
+        };
+        BackendType backend;
+
+        // Collects writes in memory, and writes them to the file only when
+        // there are this many bytes of them, or when flush(), sync() or
+        // destructor is called. Neighbouring writes are merged, so small
+        // writes of a single modification become few bigger ones. Zero
+        // disables buffering. Not used with write ahead log, because it
+        // buffers writes anyway.
+        uint64_t write_back_size;
+
+        // How much space is reserved for chunks. With exact capacity, data
+        // parts are only as big as needed. With power of two capacity, they
+        // are rounded up to the next power of two, so chunks can grow a
+        // little without being moved. Chunks are overwritten in place when
+        // they fit in their old data parts. Files created with versions of
+        // this library that did not have this option use exact capacity.
+        enum CapacityPolicy
+        {
+            CAPACITY_EXACT,
+            CAPACITY_POWER_OF_TWO
+        };
+        CapacityPolicy capacity_policy;
+
+        // Compresses chunks with a fast codec (LZ4 block format), if it
+        // makes them smaller. Reading decompresses them automatically, but
+        // compressed chunks can not be viewed. Files created with versions
+        // of this library that did not have this option are not compressed.
+        enum Compression
+        {
+            COMPRESSION_NONE,
+            COMPRESSION_LZ4
+        };
+        Compression compression;
+
+        // Stores a checksum (CRC32C) after the contents of every chunk
+        // that is set. verify() checks them, if it is asked to check the
+        // contents. Files of version 0 can not store checksums.
+        bool checksums;
+
+        // How many threads run the asynchronous operations. Threads
+        // are started when the first asynchronous operation is called.
+        unsigned async_threads;
+
+        // Stores header parts in a hash table instead of an array indexed
+        // by chunk ID, so chunk IDs can be any 64 bit numbers, like hashes,
+        // and the header area grows only with the chunks in use. Every
+        // chunk needs a little more space, and finding it may need a few
+        // reads more. Only used when a new file is created, and such files
+        // can not be opened by versions of this library without this
+        // option. IDs can not be allocated with allocateId() or add().
+        bool sparse_ids;
+
+        // Chunks with identical contents share one data part, that is
+        // found by the hash of the contents. Contents are stored in the
+        // chunk itself until another chunk gets the same contents. Shared
+        // contents are freed when the last chunk using them is removed or
+        // changed. Small chunks are never shared. Opening the file reads
+        // the headers of all data parts.
+        // Only used when a new file is created, and such files can not be
+        // opened by versions of this library without this option.
+        bool deduplication;
+
+        inline Options() :
+            cache_header_parts(false),
+            write_ahead_log(false),
+            group_commit_size(16),
+            backend(BACKEND_POSIX),
+            write_back_size(0),
+            capacity_policy(CAPACITY_EXACT),
+            compression(COMPRESSION_NONE),
+            checksums(false),
+            async_threads(4),
+            sparse_ids(false),
+            deduplication(false)
+        {
+        }
+    };
+
+    Chunkfile(std::string const& path, Options const& options = Options());
+    // Uses custom backend. Chunkfile takes ownership of it.
+    Chunkfile(Backend* backend, Options const& options = Options());
     ~Chunkfile();
 
+    // Makes room for chunk IDs smaller than given number. With sparse
+    // IDs, makes room for given number of chunks, whatever their IDs are.
     void reserve(uint64_t chunks);
 
     bool exists(uint64_t chunk_id);
@@ -52,20 +299,65 @@ public:
 
     inline void set(uint64_t chunk_id, Bytes const& bytes)
     {
-        set(chunk_id, &bytes[0], bytes.size());
+        set(chunk_id, bytes.data(), bytes.size());
     }
 
-    uint64_t getChunkSize(uint64_t chunk_id);
+    // Overwrites part of a chunk, starting from "offset". The chunk grows
+    // if the bytes go past its end, but offset must not be past the end.
+    // Bytes are written in place if the data part has room for them, so
+    // only the changed bytes are written. If the chunk must be moved,
+    // then it gets extra capacity, so growing it many times stays cheap.
+    // Compressed chunks are rewritten completely. With checksums, writing
+    // into the middle of a chunk reads the rest of it.
+    void write(uint64_t chunk_id, uint64_t offset, uint8_t const* bytes, uint64_t size);
 
-    void get(uint8_t* result, uint64_t chunk_id);
+    inline void write(uint64_t chunk_id, uint64_t offset, std::string const& str)
+    {
+        write(chunk_id, offset, (uint8_t const*)str.c_str(), str.size());
+    }
+
+    inline void write(uint64_t chunk_id, uint64_t offset, Bytes const& bytes)
+    {
+        write(chunk_id, offset, bytes.data(), bytes.size());
+    }
+
+    // Like write() to the end of the chunk
+    void append(uint64_t chunk_id, uint8_t const* bytes, uint64_t size);
+
+    inline void append(uint64_t chunk_id, std::string const& str)
+    {
+        append(chunk_id, (uint8_t const*)str.c_str(), str.size());
+    }
+
+    inline void append(uint64_t chunk_id, Bytes const& bytes)
+    {
+        append(chunk_id, bytes.data(), bytes.size());
+    }
+
+    // Creates an empty chunk with the smallest chunk id
+    // that is not in use, and returns the chunk id.
+    uint64_t allocateId();
+
+    // Like set(), but uses the smallest chunk id that
+    // is not in use, and returns the chunk id.
+    uint64_t add(uint8_t const* bytes, uint64_t size);
+
+    inline uint64_t add(std::string const& str)
+    {
+        return add((uint8_t const*)str.c_str(), str.size());
+    }
 
-    inline void get(Bytes& result, uint64_t chunk_id)
+    inline uint64_t add(Bytes const& bytes)
     {
-        uint64_t chunk_size = getChunkSize(chunk_id);
-        result.assign(chunk_size, 0);
-        get((uint8_t*)&result[0], chunk_id);
+        return add(bytes.data(), bytes.size());
     }
 
+    uint64_t getChunkSize(uint64_t chunk_id);
+
+    void get(uint8_t* result, uint64_t chunk_id);
+
+    void get(Bytes& result, uint64_t chunk_id);
+
     inline Bytes getBytes(uint64_t chunk_id)
     {
         Bytes result;
@@ -73,12 +365,7 @@ public:
         return result;
     }
 
-    inline void get(std::string& result, uint64_t chunk_id)
-    {
-        uint64_t chunk_size = getChunkSize(chunk_id);
-        result.assign(chunk_size, '\0');
-        get((uint8_t*)&result[0], chunk_id);
-    }
+    void get(std::string& result, uint64_t chunk_id);
 
     inline std::string getString(uint64_t chunk_id)
     {
@@ -87,38 +374,315 @@ public:
         return result;
     }
 
+    // Reads part of a chunk, starting from "offset". Reads less than
+    // "size" bytes if the chunk ends, and returns how many were read.
+    // Compressed chunks need to be decompressed completely.
+    uint64_t read(uint8_t* result, uint64_t chunk_id, uint64_t offset, uint64_t size);
+
+    void read(Bytes& result, uint64_t chunk_id, uint64_t offset, uint64_t size);
+
+    // Reads a chunk in pieces through a buffer of fixed size, so even big
+    // chunks can be read with little memory. The chunk is found again for
+    // every piece, so Chunkfile can be used between reads, but if the chunk
+    // is modified, then the pieces may come from different versions of it.
+    // Compressed chunks are decompressed to the buffer at once. Reader must
+    // not be used after the Chunkfile is destroyed. Every thread needs its
+    // own Reader.
+    class Reader
+    {
+    public:
+        // Returns how many bytes were read. Zero means that the chunk ended.
+        uint64_t read(uint8_t* result, uint64_t size);
+
+        inline uint64_t getSize() const
+        {
+            return size;
+        }
+
+        inline uint64_t getPosition() const
+        {
+            return pos;
+        }
+
+        inline void seek(uint64_t pos)
+        {
+            this->pos = std::min(pos, size);
+        }
+
+    private:
+        friend class Chunkfile;
+
+        Reader(Chunkfile* chunkfile, uint64_t chunk_id, uint64_t buffer_size);
+
+        Chunkfile* chunkfile;
+        uint64_t chunk_id;
+        uint64_t size;
+        uint64_t pos;
+
+        // Contains bytes of chunk starting from "buffer_pos"
+        Bytes buffer;
+        uint64_t buffer_pos;
+        uint64_t buffer_size;
+        bool compressed;
+    };
+
+    Reader getReader(uint64_t chunk_id, uint64_t buffer_size = READER_BUFFER_SIZE);
+
+    // Read only view to the contents of a chunk. It points directly to
+    // the memory mapped file, so nothing is allocated or copied. A view
+    // becomes invalid when the Chunkfile is modified in any way, for
+    // example by set(), del(), reserve() or optimize(), or when the
+    // Chunkfile is destroyed.
+    struct View
+    {
+        uint8_t const* data;
+        uint64_t size;
+    };
+
+    View getView(uint64_t chunk_id);
+
     void del(uint64_t chunk_id);
 
-    void verify();
+    // Goes through all chunks in the order they are in the file, so the
+    // file is read sequentially through a big buffer. Chunks that do not
+    // fit in the buffer are read directly. Iterator becomes invalid when
+    // the Chunkfile is modified in any way, or when it is destroyed.
+    class Iterator
+    {
+    public:
+        // Gets the next chunk. Returns false if there are no more chunks.
+        bool next(uint64_t& chunk_id, Bytes& contents);
+
+    private:
+        friend class Chunkfile;
+
+        Iterator(Chunkfile* chunkfile, uint64_t buffer_size);
+
+        // Makes sure the buffer contains the given bytes
+        void fillBuffer(uint64_t pos, uint64_t size);
+
+        Chunkfile* chunkfile;
+        // Position of the next data part
+        uint64_t pos;
+
+        // Contains bytes of file starting from "buffer_pos"
+        Bytes buffer;
+        uint64_t buffer_pos;
+        uint64_t buffer_size;
+    };
+
+    Iterator getIterator(uint64_t buffer_size = ITERATOR_BUFFER_SIZE);
+
+    // Batch operations. They work like calling get(), set() or del() for
+    // every chunk, but reads and writes are done in the order they are in
+    // the file, and neighbouring ones are merged. Header is written only
+    // once per batch. If some chunk does not exist, then nothing is done.
+    void getMany(std::vector<Bytes>& results, std::vector<uint64_t> const& chunk_ids);
+    void setMany(std::vector<uint64_t> const& chunk_ids, std::vector<Bytes> const& values);
+    void delMany(std::vector<uint64_t> const& chunk_ids);
+
+    // Values can also be given as pointers, so they do not need to be copied
+    void setMany(std::vector<uint64_t> const& chunk_ids, std::vector<Bytes const*> const& values);
+
+    // Asynchronous operations. They are run by a pool of threads owned
+    // by the Chunkfile, and errors are thrown when the result is got from
+    // the future. Operations on the same chunk are run in the order they
+    // were called, but others are run in the order they are in the file.
+    // Destructor waits until all queued operations are finished.
+    std::future<Bytes> getAsync(uint64_t chunk_id);
+    std::future<void> setAsync(uint64_t chunk_id, Bytes bytes);
+    std::future<void> delAsync(uint64_t chunk_id);
+
+    inline std::future<void> setAsync(uint64_t chunk_id, std::string const& str)
+    {
+        return setAsync(chunk_id, Bytes(str.begin(), str.end()));
+    }
+
+    // Throws CorruptedFile if the structure of the file is broken. Data
+    // area is read in big blocks, and if it is big, then its ranges are
+    // checked by multiple threads. If "check_contents" is true, then also
+    // the checksums of chunks are checked, which reads the whole file.
+    // Zero threads means one thread per every hardware thread.
+    void verify(bool check_contents = false, unsigned threads = 0);
 
     void optimize();
 
+    // Transactions are only used if write ahead log is enabled. Without
+    // them, every modification is its own transaction. Transactions can
+    // be nested, but only the outermost commit() has effect. If the
+    // Chunkfile is destroyed during a transaction, the transaction is
+    // lost, but everything committed before it is kept. If some operation
+    // fails, everything done in the ongoing transaction is thrown away. If
+    // that happens inside begin() and commit(), then the transaction fails:
+    // further modifications throw, and the outermost commit() throws too,
+    // after which the file can be used again. Transaction is shared by all
+    // threads.
+    void begin();
+    void commit();
+
+    // Writes everything committed to the file, but does
+    // not wait for it to be stored on disk.
+    void flush();
+
+    // Makes sure everything committed is stored on disk
+    void sync();
+
+    // Statistics since the Chunkfile was opened, and the current state of
+    // the file. Counting is cheap, so it is always done. Reads and writes
+    // are the calls to backend. Writes to the write ahead log are counted
+    // too. Seek is counted when a read or write does not continue from
+    // where the previous one ended.
+    struct Stats
+    {
+        uint64_t reads;
+        uint64_t writes;
+        uint64_t seeks;
+        uint64_t bytes_read;
+        uint64_t bytes_written;
+        // Bytes of contents given to set(), setMany(), write() and friends
+        uint64_t bytes_set;
+        // How many times data parts were moved to make room or to optimize
+        uint64_t data_part_moves;
+        uint64_t reserve_growths;
+        // Optimizations by optimize() and automatic ones
+        uint64_t optimizations;
+        // Bytes of contents that were set, but not written,
+        // because other chunks already had the same contents
+        uint64_t bytes_deduplicated;
+
+        uint64_t file_size;
+        uint64_t chunks;
+        // Header parts in header area. With sparse IDs, every slot
+        // of the hash table has two header parts.
+        uint64_t chunk_space_reserved;
+        // Bytes of data parts that are in use, and free space between them
+        uint64_t live_bytes;
+        uint64_t empty_space;
+        // Empty space per size of data area
+        double fragmentation;
+        // Bytes written per bytes set
+        double write_amplification;
+    };
+
+    Stats getStats();
+
 private:
 
+    class Lock;
+    class TransactionGuard;
+
     // Chunk is divided to header and data parts. The header part
     // contains the following info:
     // 1) Absolute position of data part at data area, or 2^64-1 if not in use (64 bits)
     //
+    // In version 2, header area is a hash table with linear probing, and
+    // header parts come in pairs. The first one of a pair is the chunk ID,
+    // and the second one is the position of its data part, or 2^64-1 if
+    // the slot is empty. Chunk is searched starting from the slot given by
+    // its hashed ID, and the table is kept at most half full. Data parts
+    // are like in version 1.
+    //
+    // In versions 3 and 4, chunks with identical contents can share them.
+    // Header parts of version 3 are like in version 1, and of version 4
+    // like in version 2. Shared contents are in a data part with flag
+    // SHARED, that has the hash of the contents in place of chunk ID.
+    // Chunks using them have flag REFERENCE, and their contents are the
+    // hash. References are counted when the file is opened. Contents that
+    // are not shared yet have flag HASHED, and their hash is stored after
+    // them, so the next chunk with the same contents can find them.
+    //
     // The data part contains the following info:
     // 1) Full size of data part (63 bits)
     // 2) Is in use, or is it free space (1 bit)
     // 3) Index number of chunk, if not free space (64 bits for actual data, 0 bits for free data)
+    // 4) Size of contents (40 bits), codec (8 bits) and flags (16 bits), if
+    //    not free space. Only in version 1. In version 0, the contents fill
+    //    the whole data part. Otherwise the rest of data part is unused.
+    //
+    // Compressed contents begin with their decompressed size (64 bits). If
+    // flag CHECKSUM is set, then contents are followed by their CRC32C (32
+    // bits). If flag HASHED is set, then the hash of decompressed contents
+    // (64 bits) comes after that.
 
     static unsigned const BUF_SIZE = 1024;
     static unsigned const HEADER_SIZE = 41;
     static unsigned const HEADER_MAGIC_AND_VERSION_SIZE = 17;
     static unsigned const HEADERPART_SIZE = 8;
-    static unsigned const DATAPART_DATA_MIN_SIZE = 16;
+    static unsigned const DATAPART_HEADER_SIZE_V0 = 16;
+    static unsigned const DATAPART_HEADER_SIZE_V1 = 24;
     static unsigned const DATAPART_FREESPACE_MIN_SIZE = 8;
 
+    // Version of new files
+    static uint64_t const VERSION = 1;
+    // Version of new files with sparse IDs
+    static uint64_t const VERSION_SPARSE_IDS = 2;
+    // Versions of new files with deduplication
+    static uint64_t const VERSION_DEDUPLICATION = 3;
+    static uint64_t const VERSION_SPARSE_IDS_AND_DEDUPLICATION = 4;
+    static uint64_t const HEADERPARTS_PER_SLOT = 2;
+    static uint64_t const MAX_CONTENTS_SIZE = (uint64_t(1) << 40) - 1;
+
     static uint8_t const DATAPART_TYPE_FREESPACE = 0;
     static uint8_t const DATAPART_TYPE_DATA = 1;
 
+    static uint8_t const CODEC_NONE = 0;
+    static uint8_t const CODEC_LZ4 = 1;
+    // Smaller chunks are not compressed
+    static uint64_t const COMPRESSION_MIN_SIZE = 64;
+
+    static uint16_t const FLAG_CHECKSUM = 1;
+    static uint64_t const CHECKSUM_SIZE = 4;
+    static uint16_t const FLAG_SHARED = 2;
+    static uint16_t const FLAG_REFERENCE = 4;
+    static uint64_t const REFERENCE_SIZE = 8;
+    static uint16_t const FLAG_HASHED = 8;
+    static uint64_t const CONTENT_HASH_SIZE = 8;
+    // Smaller chunks are not shared, as reference would not save much
+    static uint64_t const DEDUPLICATION_MIN_SIZE = 128;
+
     static uint64_t const MINUS_ONE = -1;
 
     static uint64_t const OPTIMIZE_THRESHOLD = 4;
+    // How many bytes of data parts are moved at most when
+    // data parts are optimized automatically during del().
+    static uint64_t const OPTIMIZE_DATA_PARTS_STEP_SIZE = 4 * 1024 * 1024;
+    static unsigned const COPY_BUF_SIZE = 64 * 1024;
+    static uint64_t const READER_BUFFER_SIZE = 64 * 1024;
+    static uint64_t const ITERATOR_BUFFER_SIZE = 4 * 1024 * 1024;
+    // Batch operations merge reads and writes up to this size. Reads are
+    // merged if the gap between them is smaller than the maximum gap.
+    static uint64_t const BATCH_IO_MAX_SIZE = 1024 * 1024;
+    static uint64_t const BATCH_IO_MAX_GAP = 4 * 1024;
+    // When data part this big is freed, its disk space is released.
+    // Only whole blocks of the given size are released.
+    static uint64_t const PUNCH_HOLE_MIN_SIZE = 64 * 1024;
+    static uint64_t const PUNCH_HOLE_BLOCK_SIZE = 4 * 1024;
+    // When log grows bigger than this, the file is synced
+    // to disk and the log is emptied.
+    static uint64_t const WAL_CHECKPOINT_SIZE = 64 * 1024 * 1024;
+    // verify() reads the file in blocks of this size. Every
+    // thread gets at least this much of the data area.
+    static uint64_t const VERIFY_BLOCK_SIZE = 4 * 1024 * 1024;
+
+    // Modified areas of file, by position. Touching areas are merged.
+    typedef std::map<uint64_t, Bytes> Writes;
 
-    std::fstream file;
+    Options options;
+
+    Backend* backend;
+
+    // Readers share the lock, writers have it alone. The thread that
+    // has the write lock is stored, so it can lock again recursively.
+    pthread_rwlock_t rwlock;
+    std::atomic<std::thread::id> write_lock_owner;
+
+    // Position for readSeek() and readBytes(). Only used when
+    // modifying, as readers must not have any shared state.
+    uint64_t read_pos;
+    uint64_t write_pos;
+
+    uint64_t version;
+    unsigned datapart_header_size;
 
     uint64_t file_size;
     uint64_t chunks;
@@ -127,31 +691,366 @@ private:
 
     uint8_t* buf;
 
+    // Positions of data parts, if header parts are cached
+    std::vector<uint64_t> header_parts;
+
+    // Reserved chunk ids that are not in use. These
+    // are found from header parts when first needed.
+    bool free_ids_loaded;
+    std::set<uint64_t> free_ids;
+
+    // Free space data parts, indexed by position and by size. The
+    // size index is used for finding the best fitting free space.
+    std::map<uint64_t, uint64_t> free_spaces;
+    std::set<std::pair<uint64_t, uint64_t> > free_spaces_by_size;
+
+    // Shared contents by their hash, if deduplication is used. The
+    // references are counted when the file is opened, so contents
+    // without references can be left behind by a crash.
+    struct SharedContents
+    {
+        uint64_t pos;
+        uint64_t references;
+    };
+    std::map<uint64_t, SharedContents> shared_contents;
+    // Chunks, whose contents are not shared yet, by the hash of their
+    // contents. Only one chunk is found by every hash.
+    std::map<uint64_t, uint64_t> hashed_contents;
+
+    // Asynchronous operations are queued per chunk, and the first one
+    // of every chunk is ready to be run. Ready chunks are indexed by
+    // position in file, and threads go through them like an elevator,
+    // starting from the position of the previous operation.
+    struct AsyncOperation
+    {
+        uint64_t pos;
+        std::function<void()> run;
+    };
+    std::mutex async_mutex;
+    std::condition_variable async_ready_cond;
+    std::vector<std::thread> async_threads;
+    bool async_stopping;
+    std::map<uint64_t, std::deque<AsyncOperation> > async_queues;
+    std::multimap<uint64_t, uint64_t> async_ready;
+    uint64_t async_pos;
+
+    // Header of data part that is in use
+    struct DataPartHeader
+    {
+        uint64_t size;
+        uint64_t chunk_id;
+        uint64_t contents_size;
+        uint8_t codec;
+        uint16_t flags;
+    };
+
+    // Reads the counters of header, and loads everything
+    // about the file that is kept in memory.
+    void readHeader();
+
     void writeHeader();
 
+    // Size of contents, and the checksum and hash after them
+    static inline uint64_t getStoredSize(DataPartHeader const& header)
+    {
+        return header.contents_size + (header.flags & FLAG_CHECKSUM ? CHECKSUM_SIZE : 0) + (header.flags & FLAG_HASHED ? CONTENT_HASH_SIZE : 0);
+    }
+
+    // Flags of data parts that are written now
+    inline uint16_t getNewDataPartFlags()
+    {
+        return options.checksums && version > 0 ? FLAG_CHECKSUM : 0;
+    }
+
+    // Data part header takes datapart_header_size bytes. Decoding
+    // throws CorruptedFile if data part is not in use or is invalid.
+    void decodeDataPartHeader(DataPartHeader& header, uint8_t const* bytes);
+    void encodeDataPartHeader(uint8_t* bytes, DataPartHeader const& header);
+    void readDataPartHeader(DataPartHeader& header, uint64_t pos);
+
+    // Writes header and contents of data part. Unused space at the end of
+    // data part is left as it is. Hash is only written with flag HASHED.
+    void writeDataPart(uint64_t pos, DataPartHeader const& header, uint8_t const* contents, uint64_t hash = 0);
+
+    // Size of data part for contents of given size, with extra capacity.
+    // Chunks that are growing by write() or append() always get extra
+    // capacity, so growing them many times does not move them every time.
+    uint64_t getDataPartSize(uint64_t contents_size, bool growing = false);
+
+    // Grows or shrinks data part so it fits the given contents,
+    // if possible without moving it. Returns the new size of data
+    // part, or zero if it could not be done. Header is not updated.
+    uint64_t resizeDataPartInPlace(uint64_t pos, uint64_t size, uint64_t contents_size, bool growing = false);
+
+    // Implements write() and append(). If "offset" is 2^64-1,
+    // then the bytes are written to the end of the chunk.
+    void writeToChunk(uint64_t chunk_id, uint64_t offset, uint8_t const* bytes, uint64_t size);
+
+    // Calculates CRC32C of bytes in the file
+    uint32_t calculateCrc32cOfFile(uint64_t pos, uint64_t size, uint32_t crc);
+
+    // Grows header area to given amount of header parts
+    void growHeaderArea(uint64_t new_reserve);
+
+    // Makes sure there is room for chunks that are about to be created.
+    // "max_chunk_id" is the biggest ID of them.
+    void reserveForNewChunks(uint64_t max_chunk_id, uint64_t new_chunks);
+
+    void loadHeaderParts();
+
+    inline bool hasSparseIds() const
+    {
+        return version == VERSION_SPARSE_IDS || version == VERSION_SPARSE_IDS_AND_DEDUPLICATION;
+    }
+
+    inline bool hasDeduplication() const
+    {
+        return version >= VERSION_DEDUPLICATION;
+    }
+
+    inline uint64_t getSlotCount() const
+    {
+        return chunk_space_reserved / HEADERPARTS_PER_SLOT;
+    }
+
+    // Header parts of hash table, when IDs are sparse. Empty
+    // slots have both chunk ID and position set to 2^64-1.
+    static uint64_t getHomeSlot(uint64_t chunk_id, uint64_t slots);
+    void readSlot(uint64_t& chunk_id, uint64_t& datapart_pos, uint64_t slot);
+    void writeSlot(uint64_t slot, uint64_t chunk_id, uint64_t datapart_pos);
+
+    // Returns the slot of chunk, or the empty slot where it should
+    // be added if it does not exist. Table must not be empty.
+    uint64_t findSlot(bool& found, uint64_t chunk_id);
+
+    // Empties slot, and moves the following chunks back
+    // if they are not in their home slot.
+    void removeSlot(uint64_t slot);
+
+    // Moves all chunks of hash table to a new one with given amount of
+    // header parts. It is written to the beginning of header area, so
+    // that area must have room for it. Header is not updated.
+    void rehashSlots(uint64_t new_reserve);
+
+    uint64_t readHeaderPart(uint64_t chunk_id);
+
+    void writeHeaderPart(uint64_t chunk_id, uint64_t datapart_pos);
+
+    void loadFreeIds();
+
+    uint64_t findFreeId();
+
+    // Results are MINUS_ONE for chunks that do not exist
+    void readHeaderParts(std::vector<uint64_t>& results, std::vector<uint64_t> const& chunk_ids);
+
+    // Pairs of chunk ID and data part position, sorted by chunk ID
+    void writeHeaderParts(std::vector<std::pair<uint64_t, uint64_t> > const& header_parts_to_write);
+
+    void loadFreeSpaces();
+
+    void addFreeSpace(uint64_t pos, uint64_t size);
+
+    // Turns area of file to free space. It is merged with free spaces
+    // next to it, and removed if it ends up at the end of the file.
+    void releaseSpace(uint64_t pos, uint64_t size);
+
+    void removeFreeSpace(uint64_t pos);
+
+    // Size is the full size of the data part, including its header.
     uint64_t findFreeSpace(uint64_t size, uint64_t min_limit = MINUS_ONE);
 
+    // Takes position that was returned by findFreeSpace() into use.
+    void useFreeSpace(uint64_t pos, uint64_t size);
+
     uint64_t getDataPartPosition(uint64_t chunk_id);
 
+    void addAsyncOperation(uint64_t chunk_id, std::function<void()> const& run);
+    void runAsyncOperations();
+    void stopAsyncThreads();
+
+    // Finds the contents of chunk. Throws if chunk does not exist.
+    void findChunkContents(uint64_t& pos, uint64_t& size, uint8_t& codec, uint64_t chunk_id);
+
+    // Finds shared contents by their hash. Throws if they do not exist.
+    void findSharedContents(uint64_t& pos, uint64_t& size, uint8_t& codec, uint64_t hash);
+
+    // Hash of contents that can be shared. It is never 2^64-1,
+    // because that marks free space when the file is verified.
+    static uint64_t calculateContentHash(uint8_t const* bytes, uint64_t size);
+
+    // Adds reference to shared contents. If they do not exist yet, but
+    // another chunk has the same contents, then its data part becomes
+    // the shared contents. Returns false if nothing has the contents,
+    // in which case the chunk must store its own contents.
+    bool addReference(uint64_t chunk_id, uint64_t hash, uint8_t const* bytes, uint64_t size);
+
+    // Reads the hash stored after contents that have flag HASHED
+    uint64_t readContentHash(uint64_t datapart_pos, DataPartHeader const& header);
+
+    // Frees shared contents, if this was their last reference
+    void releaseReference(uint64_t hash);
+
+    // Reads contents of chunk, and decompresses them if needed
+    void readContents(Bytes& result, uint64_t pos, uint64_t size, uint8_t codec);
+
+    // Compresses contents. Returns false if compressing does not make them smaller.
+    static bool compressContents(Bytes& result, uint8_t const* bytes, uint64_t size);
+    static void decompressContents(Bytes& result, uint8_t const* bytes, uint64_t size, uint8_t codec);
+
+    static void compressLz4(Bytes& result, uint8_t const* bytes, uint64_t size);
+    static void decompressLz4(uint8_t* result, uint64_t result_size, uint8_t const* bytes, uint64_t size);
+
+    // Converts data part to free space. Header part is not touched, but
+    // the reference to shared contents, or the hash of contents, is released.
+    void freeDataPart(uint64_t datapart_pos);
+
     void moveDataPart(uint64_t datapart_pos, uint64_t new_datapart_pos);
 
+    // Points header part, or shared contents, to data part that has moved
+    void updateDataPartPosition(DataPartHeader const& header, uint64_t datapart_pos);
+
+    void optimizeIfNeeded();
+
     void optimizeHeaderParts();
 
-    void optimizeDataParts();
+    // Moves data parts towards the beginning of data area and truncates the
+    // free space from the end of the file. Stops when more than given amount
+    // of bytes has been moved. Returns true if there is no free space left.
+    bool optimizeDataParts(uint64_t max_bytes_to_move = MINUS_ONE);
+
+    // Copies bytes inside the file. If areas overlap,
+    // then destination must be before the source.
+    void copyBytes(uint64_t dst_pos, uint64_t src_pos, uint64_t size);
+
+    void truncateFile(uint64_t new_size);
+
+    // Grows the file without writing the new bytes
+    void extendFile(uint64_t new_size);
+
+    // Write ahead log. Writes of the ongoing transaction are kept in
+    // transaction writes. When it is committed, they are moved to pending
+    // writes, which have the committed writes that are not yet in the
+    // file. Committed transactions wait in the log buffer until they are
+    // written to the log. Pending writes are applied to the file only
+    // after they are safely in the log. Without log, pending writes are
+    // used for write back buffering.
+    std::string wal_path;
+    int wal_fd;
+    uint64_t wal_size;
+    Bytes wal_buffer;
+    unsigned wal_buffered_commits;
+    unsigned transaction_depth;
+    // If an operation has failed inside the ongoing transaction
+    bool transaction_failed;
+    Writes transaction_writes;
+    uint64_t transaction_truncate;
+    Writes pending_writes;
+    // How many bytes have been written to pending writes. Overwritten
+    // bytes are counted again, so this may be more than the actual size.
+    uint64_t pending_writes_size;
+    uint64_t pending_truncate;
+    // Size of the actual file, without pending writes
+    uint64_t applied_file_size;
+
+    // Statistics. They are atomic, because reading functions update them.
+    std::atomic<uint64_t> stat_reads;
+    std::atomic<uint64_t> stat_writes;
+    std::atomic<uint64_t> stat_seeks;
+    std::atomic<uint64_t> stat_bytes_read;
+    std::atomic<uint64_t> stat_bytes_written;
+    std::atomic<uint64_t> stat_io_end;
+    uint64_t stat_bytes_set;
+    uint64_t stat_data_part_moves;
+    uint64_t stat_reserve_growths;
+    uint64_t stat_optimizations;
+    uint64_t stat_bytes_deduplicated;
+
+    void recoverWriteAheadLog();
+
+    // Throws away the writes of the ongoing transaction,
+    // and loads the state of the file after the last commit.
+    void rollback();
+
+    void writeWriteAheadLog();
+
+    void applyPendingWrites();
+
+    void readBytesWithPendingWrites(uint64_t pos, uint8_t* result, uint64_t size);
+
+    static void addWrite(Writes& writes, uint64_t pos, uint8_t const* bytes, uint64_t size);
+
+    static void readWrites(Writes const& writes, uint64_t pos, uint8_t* result, uint64_t size);
+
+    static void truncateWrites(Writes& writes, uint64_t size);
+
+    static uint64_t calculateChecksum(uint8_t const* bytes, uint64_t size);
+
+    // CRC32C. Can be calculated in pieces by giving
+    // the previous result as "crc" of the next piece.
+    static uint32_t calculateCrc32c(uint8_t const* bytes, uint64_t size, uint32_t crc = 0);
+
+    // Verifies range of data parts. "data_parts" has positions and chunk
+    // IDs of all data parts in the file order. Free spaces have ID 2^64-1,
+    // and shared contents have their hash. References to shared contents
+    // found in the range are counted to "references", and chunks with
+    // hashed contents are collected to "hashes".
+    void verifyDataParts(std::vector<std::pair<uint64_t, uint64_t> > const& data_parts, size_t begin, size_t end, bool check_contents, std::map<uint64_t, uint64_t>& references, std::map<uint64_t, uint64_t>& hashes);
+
+    // Returns memory that contains the whole file
+    uint8_t const* mapFile();
+
+    Chunkfile(Backend* backend, std::string const& path, Options const& options);
+
+    static Backend* createBackend(std::string const& path, Options const& options);
 
     inline void readSeek(uint64_t seek)
     {
-        file.seekg(seek);
+        read_pos = seek;
     }
 
     inline void readBytes(uint8_t* result, uint64_t size)
     {
-// TODO: Support caching and atomic operations!
-        assert(!file.eof());
-        file.read((char*)result, size);
-        if (file.eof()) {
-            throw CorruptedFile();
+        readBytesAt(read_pos, result, size);
+        read_pos += size;
+    }
+
+    // Reading functions that do not use any shared state
+    inline void readBytesAt(uint64_t pos, uint8_t* result, uint64_t size)
+    {
+        if (!pending_writes.empty() || !transaction_writes.empty()) {
+            readBytesWithPendingWrites(pos, result, size);
+            return;
         }
+        readFromBackend(result, pos, size);
+    }
+
+    // All reads and writes to backend go through these, so they are counted
+    inline void readFromBackend(uint8_t* result, uint64_t pos, uint64_t size)
+    {
+        countIo(stat_reads, stat_bytes_read, pos, size);
+        backend->read(result, pos, size);
+    }
+
+    inline void writeToBackend(uint64_t pos, uint8_t const* bytes, uint64_t size)
+    {
+        countIo(stat_writes, stat_bytes_written, pos, size);
+        backend->write(pos, bytes, size);
+    }
+
+    inline void countIo(std::atomic<uint64_t>& calls, std::atomic<uint64_t>& bytes, uint64_t pos, uint64_t size)
+    {
+        calls.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        if (stat_io_end.exchange(pos + size, std::memory_order_relaxed) != pos) {
+            stat_seeks.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    inline uint64_t readUInt64At(uint64_t pos)
+    {
+        uint8_t bytes[8];
+        readBytesAt(pos, bytes, 8);
+        return decodeUInt64(bytes);
     }
 
     inline void readString(std::string& result, uint64_t size)
@@ -169,15 +1068,30 @@ private:
     inline uint64_t readUInt64()
     {
         readBytes(buf, 8);
+        return decodeUInt64(buf);
+    }
+
+    static inline uint32_t decodeUInt32(uint8_t const* bytes)
+    {
+        uint32_t result = 0;
+        result += uint32_t(bytes[0]) << 0;
+        result += uint32_t(bytes[1]) << 8;
+        result += uint32_t(bytes[2]) << 16;
+        result += uint32_t(bytes[3]) << 24;
+        return result;
+    }
+
+    static inline uint64_t decodeUInt64(uint8_t const* bytes)
+    {
         uint64_t result = 0;
-        result += uint64_t(buf[0]) << 0;
-        result += uint64_t(buf[1]) << 8;
-        result += uint64_t(buf[2]) << 16;
-        result += uint64_t(buf[3]) << 24;
-        result += uint64_t(buf[4]) << 32;
-        result += uint64_t(buf[5]) << 40;
-        result += uint64_t(buf[6]) << 48;
-        result += uint64_t(buf[7]) << 56;
+        result += uint64_t(bytes[0]) << 0;
+        result += uint64_t(bytes[1]) << 8;
+        result += uint64_t(bytes[2]) << 16;
+        result += uint64_t(bytes[3]) << 24;
+        result += uint64_t(bytes[4]) << 32;
+        result += uint64_t(bytes[5]) << 40;
+        result += uint64_t(bytes[6]) << 48;
+        result += uint64_t(bytes[7]) << 56;
         return result;
     }
 
@@ -190,13 +1104,29 @@ private:
 
     inline void writeSeek(uint64_t seek)
     {
-        file.seekp(seek);
+        write_pos = seek;
     }
 
     inline void writeBytes(uint8_t const* bytes, uint64_t size)
     {
-// TODO: Support caching and atomic operations!
-        file.write((char const*)bytes, size);
+        if (options.write_ahead_log) {
+            assert(transaction_depth > 0);
+            addWrite(transaction_writes, write_pos, bytes, size);
+        } else if (size < options.write_back_size) {
+            addWrite(pending_writes, write_pos, bytes, size);
+            pending_writes_size += size;
+            if (pending_writes_size >= options.write_back_size) {
+                applyPendingWrites();
+            }
+        } else {
+            // Big writes are not buffered, but the buffered ones go first
+            if (options.write_back_size > 0) {
+                applyPendingWrites();
+                applied_file_size = std::max(applied_file_size, write_pos + size);
+            }
+            writeToBackend(write_pos, bytes, size);
+        }
+        write_pos += size;
     }
 
     inline void writeString(std::string const& str)
@@ -212,35 +1142,176 @@ private:
 
     inline void writeUInt64(uint64_t i)
     {
-        buf[0] = (i >> 0) & 0xff;
-        buf[1] = (i >> 8) & 0xff;
-        buf[2] = (i >> 16) & 0xff;
-        buf[3] = (i >> 24) & 0xff;
-        buf[4] = (i >> 32) & 0xff;
-        buf[5] = (i >> 40) & 0xff;
-        buf[6] = (i >> 48) & 0xff;
-        buf[7] = (i >> 56) & 0xff;
+        encodeUInt64(buf, i);
         writeBytes(buf, 8);
     }
 
+    static inline void encodeUInt32(uint8_t* bytes, uint32_t i)
+    {
+        bytes[0] = (i >> 0) & 0xff;
+        bytes[1] = (i >> 8) & 0xff;
+        bytes[2] = (i >> 16) & 0xff;
+        bytes[3] = (i >> 24) & 0xff;
+    }
+
+    static inline void encodeUInt64(uint8_t* bytes, uint64_t i)
+    {
+        bytes[0] = (i >> 0) & 0xff;
+        bytes[1] = (i >> 8) & 0xff;
+        bytes[2] = (i >> 16) & 0xff;
+        bytes[3] = (i >> 24) & 0xff;
+        bytes[4] = (i >> 32) & 0xff;
+        bytes[5] = (i >> 40) & 0xff;
+        bytes[6] = (i >> 48) & 0xff;
+        bytes[7] = (i >> 56) & 0xff;
+    }
+
+    static inline void appendUInt64(Bytes& bytes, uint64_t i)
+    {
+        bytes.resize(bytes.size() + 8);
+        encodeUInt64(&bytes[bytes.size() - 8], i);
+    }
+
     inline void writeUInt63AndUInt1(uint64_t i1, uint8_t i2)
     {
         writeUInt64((i1 & 0x7fffffffffffffff) + (uint64_t(i2) << 63));
     }
 
-    inline void writeUnexpected(uint64_t size)
+    inline uint64_t getFileSize()
+    {
+        return backend->getSize();
+    }
+};
+
+// Spreads chunks over multiple Chunkfiles (shards) in a directory. Every
+// shard has its own lock and space allocation, so operations on different
+// shards can be run from multiple threads at the same time. Batch
+// operations, verify(), optimize() and sync() run every shard in its own
+// thread. Shard files can be replaced with symbolic links, to put them on
+// different disks. There are no transactions, because they could not be
+// atomic over multiple files.
+class ShardedChunkfile
+{
+
+public:
+
+    typedef Chunkfile::Bytes Bytes;
+
+    struct Options
     {
-// TODO: Maybe there is more optimal way of doing this? Some kind of system call that just increases the size?
-        for (uint64_t i = 0; i < size; i += BUF_SIZE) {
-            writeBytes(buf, std::min<uint64_t>(BUF_SIZE, size - i));
+        // How many shards there are
+        unsigned shards;
+
+        // How chunk IDs are divided to shards. With hash partitioning,
+        // chunks are spread evenly. With range partitioning, every shard
+        // has "range_size" successive chunk IDs, and the last one has the
+        // rest of them too.
+        enum Partitioning
+        {
+            PARTITION_HASH,
+            PARTITION_RANGE
+        };
+        Partitioning partitioning;
+        uint64_t range_size;
+
+        // Options of every shard
+        Chunkfile::Options chunkfile;
+
+        inline Options() :
+            shards(4),
+            partitioning(PARTITION_HASH),
+            range_size(uint64_t(1) << 32)
+        {
         }
+    };
+
+    // Shard count and partitioning are only used when the directory is
+    // created. After that, they are read from file "shards" in it. With
+    // memory backend, nothing is stored and path is not used.
+    ShardedChunkfile(std::string const& path, Options const& options = Options());
+    ~ShardedChunkfile();
+
+    unsigned getShardCount() const;
+
+    unsigned getShardIndex(uint64_t chunk_id) const;
+
+    // Gives access to a shard, for example for iterating it
+    Chunkfile& getShard(unsigned index);
+
+    bool exists(uint64_t chunk_id);
+
+    void set(uint64_t chunk_id, uint8_t const* bytes, uint64_t size);
+
+    inline void set(uint64_t chunk_id, std::string const& str)
+    {
+        set(chunk_id, (uint8_t const*)str.c_str(), str.size());
     }
 
-    inline uint64_t getFileSize()
+    inline void set(uint64_t chunk_id, Bytes const& bytes)
     {
-        file.seekg(0, std::ios::end);
-        return file.tellg();
+        set(chunk_id, bytes.data(), bytes.size());
+    }
+
+    void write(uint64_t chunk_id, uint64_t offset, uint8_t const* bytes, uint64_t size);
+
+    void append(uint64_t chunk_id, uint8_t const* bytes, uint64_t size);
+
+    uint64_t getChunkSize(uint64_t chunk_id);
+
+    void get(Bytes& result, uint64_t chunk_id);
+
+    void get(std::string& result, uint64_t chunk_id);
+
+    inline std::string getString(uint64_t chunk_id)
+    {
+        std::string result;
+        get(result, chunk_id);
+        return result;
     }
+
+    uint64_t read(uint8_t* result, uint64_t chunk_id, uint64_t offset, uint64_t size);
+
+    Chunkfile::Reader getReader(uint64_t chunk_id, uint64_t buffer_size = READER_BUFFER_SIZE);
+
+    Chunkfile::View getView(uint64_t chunk_id);
+
+    void del(uint64_t chunk_id);
+
+    // Batch operations are split to shards, which run in parallel. Like
+    // in Chunkfile, delMany() does nothing if some chunk does not exist.
+    // But it is not atomic over shards: if another thread removes the same
+    // chunks at the same time, or a shard fails, some shards may be done.
+    void getMany(std::vector<Bytes>& results, std::vector<uint64_t> const& chunk_ids);
+    void setMany(std::vector<uint64_t> const& chunk_ids, std::vector<Bytes> const& values);
+    void delMany(std::vector<uint64_t> const& chunk_ids);
+
+    // Threads are divided between shards
+    void verify(bool check_contents = false, unsigned threads = 0);
+
+    void optimize();
+
+    void flush();
+
+    void sync();
+
+    // Sums of statistics of all shards
+    Chunkfile::Stats getStats();
+
+private:
+
+    static uint64_t const READER_BUFFER_SIZE = 64 * 1024;
+
+    Options options;
+
+    std::vector<Chunkfile*> shards;
+
+    // Reads the configuration from file "shards" in the directory,
+    // or writes it there if the directory is new.
+    void loadConfiguration(std::string const& path);
+
+    // Runs function for every shard that is marked, each in its
+    // own thread. If some of them fail, the first error is thrown.
+    void runInShards(std::vector<bool> const& marked, std::function<void(unsigned)> const& run);
 };
 
 #endif
@@ -1,12 +1,20 @@
 #include "chunkfile.hpp"
 
+#include <atomic>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <stdexcept>
 #include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 void testTrue(bool b)
 {
@@ -22,6 +30,12 @@ void testFalse(bool b)
     }
 }
 
+uint64_t getFileSize(std::string const& path)
+{
+    std::ifstream f(path.c_str(), std::ios::binary | std::ios::ate);
+    return f.tellg();
+}
+
 void testFileCreation(std::string const& path)
 {
     // Make sure file does not exist
@@ -206,6 +220,1504 @@ void testRemovingChunks(std::string const& path)
     }
 }
 
+void testReusingFreeSpace(std::string const& path)
+{
+    std::string value_a(100, 'a');
+    std::string value_b(100, 'b');
+
+    // Write to file
+    uint64_t file_size_after_first_write;
+    {
+        Chunkfile file(path);
+        for (uint64_t chunk_id = 0; chunk_id < 10; ++ chunk_id) {
+            file.set(chunk_id, value_a);
+        }
+        file.verify();
+    }
+    file_size_after_first_write = getFileSize(path);
+
+    // Replace chunks many times
+    {
+        Chunkfile file(path);
+        for (unsigned round = 0; round < 100; ++ round) {
+            uint64_t chunk_id = round % 10;
+            file.set(chunk_id, round % 2 ? value_a : value_b);
+        }
+        file.verify();
+    }
+
+    // Test that file did not grow
+    testTrue(getFileSize(path) <= file_size_after_first_write + 16 + value_a.size());
+    {
+        Chunkfile file(path);
+        for (uint64_t chunk_id = 0; chunk_id < 10; ++ chunk_id) {
+            testTrue(file.exists(chunk_id));
+            testTrue(file.getString(chunk_id).size() == value_a.size());
+        }
+        for (uint64_t chunk_id = 0; chunk_id < 10; ++ chunk_id) {
+            file.del(chunk_id);
+        }
+        file.verify();
+    }
+}
+
+void testOptimizingDataParts(std::string const& path)
+{
+    std::string value(1000, 'x');
+
+    // Write to file
+    {
+        Chunkfile file(path);
+        for (uint64_t chunk_id = 0; chunk_id < 100; ++ chunk_id) {
+            file.set(chunk_id, value + std::to_string(chunk_id));
+        }
+        file.verify();
+    }
+    uint64_t file_size_before_deleting = getFileSize(path);
+
+    // Remove most of the chunks. This should trigger optimizations.
+    {
+        Chunkfile file(path);
+        for (uint64_t chunk_id = 0; chunk_id < 100; ++ chunk_id) {
+            if (chunk_id % 10 != 0) {
+                file.del(chunk_id);
+            }
+        }
+        file.verify();
+    }
+    testTrue(getFileSize(path) * 2 < file_size_before_deleting);
+
+    // Test
+    {
+        Chunkfile file(path);
+        for (uint64_t chunk_id = 0; chunk_id < 100; ++ chunk_id) {
+            if (chunk_id % 10 != 0) {
+                testFalse(file.exists(chunk_id));
+            } else {
+                testTrue(file.getString(chunk_id) == value + std::to_string(chunk_id));
+            }
+        }
+        file.verify();
+        for (uint64_t chunk_id = 0; chunk_id < 100; chunk_id += 10) {
+            file.del(chunk_id);
+        }
+        file.optimize();
+        file.verify();
+    }
+}
+
+void testCachingHeaderParts(std::string const& path)
+{
+    Chunkfile::Options options;
+    options.cache_header_parts = true;
+
+    // Write to file
+    {
+        Chunkfile file(path, options);
+        for (uint64_t chunk_id = 0; chunk_id < 20; ++ chunk_id) {
+            file.set(chunk_id, std::string("cached ") + std::to_string(chunk_id));
+        }
+        for (uint64_t chunk_id = 0; chunk_id < 20; chunk_id += 3) {
+            file.del(chunk_id);
+        }
+        file.verify();
+    }
+
+    // Test with and without cache
+    for (unsigned i = 0; i < 2; ++ i) {
+        Chunkfile file(path, i == 0 ? options : Chunkfile::Options());
+        for (uint64_t chunk_id = 0; chunk_id < 20; ++ chunk_id) {
+            if (chunk_id % 3 == 0) {
+                testFalse(file.exists(chunk_id));
+            } else {
+                testTrue(file.getString(chunk_id) == std::string("cached ") + std::to_string(chunk_id));
+            }
+        }
+        file.verify();
+    }
+
+    // Clean
+    {
+        Chunkfile file(path, options);
+        for (uint64_t chunk_id = 0; chunk_id < 20; ++ chunk_id) {
+            if (file.exists(chunk_id)) {
+                file.del(chunk_id);
+            }
+        }
+        file.verify();
+    }
+}
+
+void testViews(std::string const& path)
+{
+    // Write to file
+    {
+        Chunkfile file(path);
+        file.set(0, std::string("first view"));
+        file.set(1, std::string("second view"));
+    }
+
+    // Test
+    {
+        Chunkfile file(path);
+        Chunkfile::View view = file.getView(1);
+        testTrue(std::string((char const*)view.data, view.size) == std::string("second view"));
+
+        // Views must see changes to the file
+        file.set(2, std::string(10000, 'z'));
+        view = file.getView(2);
+        testTrue(std::string((char const*)view.data, view.size) == std::string(10000, 'z'));
+        view = file.getView(0);
+        testTrue(std::string((char const*)view.data, view.size) == std::string("first view"));
+
+        file.del(0);
+        file.del(1);
+        file.del(2);
+        file.verify();
+    }
+}
+
+void testWriteAheadLog(std::string const& path)
+{
+    Chunkfile::Options options;
+    options.write_ahead_log = true;
+
+    // Write to file using transactions
+    {
+        Chunkfile file(path, options);
+        file.begin();
+        for (uint64_t chunk_id = 0; chunk_id < 10; ++ chunk_id) {
+            file.set(chunk_id, std::string("committed"));
+        }
+        file.commit();
+        file.set(10, std::string("committed alone"));
+        file.verify();
+    }
+
+    // Crash in the middle of a transaction
+    pid_t pid = fork();
+    if (pid == 0) {
+        Chunkfile file(path, options);
+        file.begin();
+        for (uint64_t chunk_id = 0; chunk_id < 10; ++ chunk_id) {
+            file.set(chunk_id, std::string("not committed"));
+            if (chunk_id == 5) {
+                file.sync();
+                _exit(EXIT_SUCCESS);
+            }
+        }
+        file.commit();
+        _exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    testTrue(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+    // Test
+    {
+        Chunkfile file(path);
+        for (uint64_t chunk_id = 0; chunk_id < 10; ++ chunk_id) {
+            testTrue(file.getString(chunk_id) == std::string("committed"));
+        }
+        testTrue(file.getString(10) == std::string("committed alone"));
+        file.verify();
+        for (uint64_t chunk_id = 0; chunk_id <= 10; ++ chunk_id) {
+            file.del(chunk_id);
+        }
+        file.verify();
+    }
+
+    // Operation that fails halfway must not leave anything to be
+    // committed later. Data part of chunk 2 has invalid chunk ID, so
+    // growing the header area fails after moving chunks 0 and 1.
+    testFalse(::remove(path.c_str()));
+    {
+        Chunkfile file(path, options);
+        file.reserve(10);
+        for (uint64_t chunk_id = 0; chunk_id < 10; ++ chunk_id) {
+            file.set(chunk_id, std::string(100, 'a' + chunk_id));
+        }
+        file.sync();
+        uint64_t file_size = getFileSize(path);
+        // Header 41 bytes, header parts 10 * 8 and data parts 124 bytes
+        uint64_t chunk_id_pos = 41 + 10 * 8 + 2 * 124 + 8;
+        std::fstream f(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(chunk_id_pos);
+        f.put(char(0xff));
+        f.flush();
+
+        bool setting_failed = false;
+        try {
+            file.set(100, std::string("grows header area"));
+        } catch (Chunkfile::CorruptedFile const&) {
+            setting_failed = true;
+        }
+        testTrue(setting_failed);
+        testFalse(file.exists(100));
+
+        f.seekp(chunk_id_pos);
+        f.put(2);
+        f.flush();
+        file.set(1, std::string("committed after failure"));
+        file.sync();
+        testTrue(getFileSize(path) == file_size);
+        file.verify();
+    }
+    {
+        Chunkfile file(path, options);
+        file.verify();
+        testTrue(file.getString(0) == std::string(100, 'a'));
+        testTrue(file.getString(1) == std::string("committed after failure"));
+        testTrue(file.getString(2) == std::string(100, 'c'));
+        for (uint64_t chunk_id = 0; chunk_id < 10; ++ chunk_id) {
+            file.del(chunk_id);
+        }
+        file.optimize();
+        file.verify();
+    }
+
+    // Operation that fails inside begin() and commit() makes the
+    // whole transaction fail, including what was done before it
+    testFalse(::remove(path.c_str()));
+    {
+        Chunkfile file(path, options);
+        file.set(0, std::string("committed"));
+        file.begin();
+        file.set(1, std::string("not committed"));
+        bool writing_failed = false;
+        try {
+            file.write(99, 0, std::string("does not exist"));
+        } catch (Chunkfile::ChunkDoesNotExist const&) {
+            writing_failed = true;
+        }
+        testTrue(writing_failed);
+        bool setting_failed = false;
+        try {
+            file.set(2, std::string("not committed"));
+        } catch (std::runtime_error const&) {
+            setting_failed = true;
+        }
+        testTrue(setting_failed);
+        bool committing_failed = false;
+        try {
+            file.commit();
+        } catch (std::runtime_error const&) {
+            committing_failed = true;
+        }
+        testTrue(committing_failed);
+        testFalse(file.exists(1));
+        testFalse(file.exists(2));
+
+        file.set(2, std::string("committed after failure"));
+        file.verify();
+    }
+    {
+        Chunkfile file(path, options);
+        file.verify();
+        testTrue(file.getString(0) == std::string("committed"));
+        testFalse(file.exists(1));
+        testTrue(file.getString(2) == std::string("committed after failure"));
+        file.del(0);
+        file.del(2);
+        file.optimize();
+        file.verify();
+    }
+}
+
+void testBatchOperations(std::string const& path)
+{
+    // Write to file
+    {
+        std::vector<uint64_t> chunk_ids;
+        std::vector<Chunkfile::Bytes> values;
+        for (uint64_t chunk_id = 0; chunk_id < 50; ++ chunk_id) {
+            chunk_ids.push_back(chunk_id * 3);
+            values.push_back(Chunkfile::Bytes(chunk_id * 10, uint8_t(chunk_id)));
+        }
+        Chunkfile file(path);
+        file.setMany(chunk_ids, values);
+        file.verify();
+    }
+
+    // Test
+    {
+        Chunkfile file(path);
+        std::vector<uint64_t> chunk_ids;
+        for (uint64_t chunk_id = 50; chunk_id > 0; -- chunk_id) {
+            chunk_ids.push_back((chunk_id - 1) * 3);
+        }
+        std::vector<Chunkfile::Bytes> values;
+        file.getMany(values, chunk_ids);
+        testTrue(values.size() == 50);
+        for (uint64_t chunk_id = 0; chunk_id < 50; ++ chunk_id) {
+            testTrue(values[49 - chunk_id] == Chunkfile::Bytes(chunk_id * 10, uint8_t(chunk_id)));
+        }
+
+        // Nothing should be removed if some of the chunks do not exist
+        chunk_ids.push_back(1);
+        bool exception_thrown = false;
+        try {
+            file.delMany(chunk_ids);
+        }
+        catch (Chunkfile::ChunkDoesNotExist const&) {
+            exception_thrown = true;
+        }
+        testTrue(exception_thrown);
+        testTrue(file.exists(0));
+
+        chunk_ids.pop_back();
+        file.delMany(chunk_ids);
+        for (uint64_t chunk_id = 0; chunk_id < 150; ++ chunk_id) {
+            testFalse(file.exists(chunk_id));
+        }
+        file.verify();
+    }
+}
+
+void testBackends(std::string const& path)
+{
+    // Memory backend
+    {
+        Chunkfile::Options options;
+        options.backend = Chunkfile::Options::BACKEND_MEMORY;
+        Chunkfile file(path, options);
+        for (uint64_t chunk_id = 0; chunk_id < 20; ++ chunk_id) {
+            file.set(chunk_id, std::string(chunk_id * 5, 'm'));
+        }
+        for (uint64_t chunk_id = 0; chunk_id < 20; chunk_id += 2) {
+            file.del(chunk_id);
+        }
+        for (uint64_t chunk_id = 1; chunk_id < 20; chunk_id += 2) {
+            testTrue(file.getString(chunk_id) == std::string(chunk_id * 5, 'm'));
+        }
+        Chunkfile::View view = file.getView(19);
+        testTrue(std::string((char const*)view.data, view.size) == std::string(19 * 5, 'm'));
+        file.verify();
+    }
+    // Memory backend should not touch the actual file
+    {
+        Chunkfile file(path);
+        testFalse(file.exists(1));
+    }
+
+    // Fstream backend
+    Chunkfile::Options options;
+    options.backend = Chunkfile::Options::BACKEND_FSTREAM;
+    {
+        Chunkfile file(path, options);
+        file.set(0, std::string("fstream"));
+        file.verify();
+    }
+    {
+        Chunkfile file(path);
+        testTrue(file.getString(0) == std::string("fstream"));
+        file.set(1, std::string("posix"));
+    }
+    {
+        Chunkfile file(path, options);
+        testTrue(file.getString(1) == std::string("posix"));
+        file.del(0);
+        file.del(1);
+        file.verify();
+    }
+
+    // Mmap backend. Big chunk makes the mapping grow.
+    options.backend = Chunkfile::Options::BACKEND_MMAP;
+    {
+        Chunkfile file(path, options);
+        for (uint64_t chunk_id = 0; chunk_id < 20; ++ chunk_id) {
+            file.set(chunk_id, std::string(chunk_id * 5, 'm'));
+        }
+        file.set(20, std::string(3 * 1024 * 1024, 'b'));
+        for (uint64_t chunk_id = 0; chunk_id < 20; chunk_id += 2) {
+            file.del(chunk_id);
+        }
+        Chunkfile::View view = file.getView(19);
+        testTrue(std::string((char const*)view.data, view.size) == std::string(19 * 5, 'm'));
+        file.sync();
+        file.verify(true);
+    }
+    {
+        Chunkfile file(path);
+        testTrue(file.getString(20) == std::string(3 * 1024 * 1024, 'b'));
+        for (uint64_t chunk_id = 1; chunk_id < 20; chunk_id += 2) {
+            testTrue(file.getString(chunk_id) == std::string(chunk_id * 5, 'm'));
+        }
+        file.set(0, std::string("posix"));
+    }
+    {
+        Chunkfile file(path, options);
+        testTrue(file.getString(0) == std::string("posix"));
+        // Empty chunk reads and writes nothing
+        file.set(1, Chunkfile::Bytes());
+        testTrue(file.getString(1).empty());
+        for (uint64_t chunk_id = 0; chunk_id <= 20; ++ chunk_id) {
+            if (file.exists(chunk_id)) {
+                file.del(chunk_id);
+            }
+        }
+        file.verify();
+    }
+    testTrue(getFileSize(path) == 41);
+}
+
+void testConcurrentReading(std::string const& path)
+{
+    Chunkfile file(path);
+    for (uint64_t chunk_id = 0; chunk_id < 50; ++ chunk_id) {
+        file.set(chunk_id, std::string(chunk_id * 10, 'a'));
+    }
+
+    // Readers should always see whole chunks while the writer replaces them
+    std::atomic<bool> failed(false);
+    std::atomic<bool> writing(true);
+    std::vector<std::thread> readers;
+    for (unsigned i = 0; i < 4; ++ i) {
+        readers.push_back(std::thread([&file, &failed, &writing, i]() {
+            try {
+                uint64_t chunk_id = i;
+                while (writing.load()) {
+                    chunk_id = (chunk_id + 7) % 50;
+                    std::string chunk = file.getString(chunk_id);
+                    if (chunk.size() != chunk_id * 10 || chunk.find_first_not_of(chunk[0]) != std::string::npos) {
+                        failed.store(true);
+                    }
+                    std::vector<Chunkfile::Bytes> chunks;
+                    file.getMany(chunks, std::vector<uint64_t>({chunk_id, (chunk_id + 1) % 50}));
+                    if (chunks[0].size() != chunk_id * 10 || !file.exists(chunk_id)) {
+                        failed.store(true);
+                    }
+                }
+            } catch (...) {
+                failed.store(true);
+            }
+        }));
+    }
+    for (unsigned round = 0; round < 20; ++ round) {
+        for (uint64_t chunk_id = 0; chunk_id < 50; ++ chunk_id) {
+            file.set(chunk_id, std::string(chunk_id * 10, 'b' + round));
+        }
+    }
+    writing.store(false);
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    testFalse(failed.load());
+
+    for (uint64_t chunk_id = 0; chunk_id < 50; ++ chunk_id) {
+        file.del(chunk_id);
+    }
+    file.verify();
+}
+
+void testAsyncOperations(std::string const& path)
+{
+    Chunkfile file(path);
+
+    // Operations of same chunk should happen in order
+    std::vector<std::future<void> > writes;
+    for (uint64_t chunk_id = 0; chunk_id < 100; ++ chunk_id) {
+        writes.push_back(file.setAsync(chunk_id, std::string(chunk_id, 'x')));
+        writes.push_back(file.setAsync(chunk_id, std::string(chunk_id * 2, 'y')));
+    }
+    std::vector<std::future<Chunkfile::Bytes> > reads;
+    for (uint64_t chunk_id = 100; chunk_id > 0; -- chunk_id) {
+        reads.push_back(file.getAsync(chunk_id - 1));
+    }
+    for (std::future<void>& write : writes) {
+        write.get();
+    }
+    for (uint64_t i = 0; i < reads.size(); ++ i) {
+        uint64_t chunk_id = 99 - i;
+        Chunkfile::Bytes chunk = reads[i].get();
+        testTrue(chunk == Chunkfile::Bytes(chunk_id * 2, 'y'));
+    }
+
+    // Errors should come through the future
+    std::future<void> del = file.delAsync(5);
+    std::future<Chunkfile::Bytes> deleted = file.getAsync(5);
+    del.get();
+    bool thrown = false;
+    try {
+        deleted.get();
+    }
+    catch (Chunkfile::ChunkDoesNotExist const&) {
+        thrown = true;
+    }
+    testTrue(thrown);
+
+    for (uint64_t chunk_id = 0; chunk_id < 100; ++ chunk_id) {
+        if (chunk_id != 5) {
+            file.delAsync(chunk_id);
+        }
+    }
+}
+
+void testReleasingDiskSpace(std::string const& path)
+{
+    struct stat file_stat;
+    Chunkfile file(path);
+    file.set(0, std::string(2 * 1024 * 1024, 'a'));
+    file.set(1, std::string(1024 * 1024, 'b'));
+    file.set(2, std::string(2 * 1024 * 1024, 'c'));
+
+    // Reserving lots of chunks should not need writing the whole header
+    file.reserve(100000);
+    testTrue(file.getString(2) == std::string(2 * 1024 * 1024, 'c'));
+    file.verify();
+
+    // Freed space in the middle should not use disk
+    uint64_t size_before = getFileSize(path);
+    testFalse(::stat(path.c_str(), &file_stat));
+    uint64_t blocks_before = file_stat.st_blocks;
+    file.del(1);
+    testTrue(getFileSize(path) == size_before);
+    testFalse(::stat(path.c_str(), &file_stat));
+    testTrue(uint64_t(file_stat.st_blocks) < blocks_before);
+    file.verify();
+
+    // Freed space at the end should be removed from the file
+    file.del(2);
+    testTrue(getFileSize(path) < size_before - 3 * 1024 * 1024);
+    testTrue(file.getString(0) == std::string(2 * 1024 * 1024, 'a'));
+    file.verify();
+    file.del(0);
+}
+
+class CountingBackend : public Chunkfile::PosixBackend
+{
+public:
+    inline CountingBackend(std::string const& path, unsigned* writes) :
+        Chunkfile::PosixBackend(path),
+        bytes_written(0),
+        writes(writes)
+    {
+    }
+    void write(uint64_t pos, uint8_t const* bytes, uint64_t size)
+    {
+        ++ *writes;
+        bytes_written += size;
+        Chunkfile::PosixBackend::write(pos, bytes, size);
+    }
+    uint64_t bytes_written;
+private:
+    unsigned* writes;
+};
+
+void testWriteBackBuffering(std::string const& path)
+{
+    Chunkfile::Options options;
+    options.write_back_size = 1024 * 1024;
+    unsigned writes = 0;
+    {
+        Chunkfile file(new CountingBackend(path, &writes), options);
+        for (uint64_t chunk_id = 0; chunk_id < 100; ++ chunk_id) {
+            file.set(chunk_id, std::string(chunk_id + 1, 'w'));
+        }
+        testTrue(file.getString(99) == std::string(100, 'w'));
+        testTrue(writes == 0);
+        // Buffered writes should be merged
+        file.flush();
+        testTrue(writes > 0 && writes < 10);
+        file.verify();
+
+        // Too big writes should not be buffered
+        file.del(50);
+        file.set(100, std::string(2 * 1024 * 1024, 'x'));
+        writes = 0;
+        file.del(10);
+        testTrue(writes == 0);
+    }
+    // Destructor should write everything
+    testTrue(writes > 0);
+    {
+        Chunkfile file(path);
+        testFalse(file.exists(10));
+        testFalse(file.exists(50));
+        testTrue(file.getString(99) == std::string(100, 'w'));
+        testTrue(file.getString(100) == std::string(2 * 1024 * 1024, 'x'));
+        file.verify();
+        for (uint64_t chunk_id = 0; chunk_id <= 100; ++ chunk_id) {
+            if (file.exists(chunk_id)) {
+                file.del(chunk_id);
+            }
+        }
+    }
+}
+
+void testAllocatingIds(std::string const& path)
+{
+    Chunkfile file(path);
+    testTrue(file.allocateId() == 0);
+    testTrue(file.exists(0));
+    testTrue(file.getChunkSize(0) == 0);
+    for (uint64_t chunk_id = 1; chunk_id < 10; ++ chunk_id) {
+        testTrue(file.add(std::to_string(chunk_id)) == chunk_id);
+    }
+    file.set(20, std::string("twenty"));
+
+    // Smallest free ids should be used first
+    file.del(7);
+    file.del(3);
+    testTrue(file.add(std::string("three")) == 3);
+    testTrue(file.add(std::string("seven")) == 7);
+    testTrue(file.add(std::string("ten")) == 10);
+    testTrue(file.getString(3) == std::string("three"));
+    testTrue(file.getString(7) == std::string("seven"));
+    file.verify();
+
+    // Removing chunks from the end should shrink the header area
+    for (uint64_t chunk_id = 0; chunk_id <= 20; ++ chunk_id) {
+        if (file.exists(chunk_id)) {
+            file.del(chunk_id);
+        }
+    }
+    file.verify();
+    testTrue(file.add(std::string("zero")) == 0);
+    file.del(0);
+}
+
+void testOverwritingInPlace(std::string const& path)
+{
+    // Chunks that fit in their old place should not grow the file
+    {
+        Chunkfile file(path);
+        for (uint64_t chunk_id = 0; chunk_id < 3; ++ chunk_id) {
+            file.set(chunk_id, std::string(100, 'a'));
+        }
+        uint64_t file_size = getFileSize(path);
+        file.set(1, std::string(100, 'b'));
+        file.set(1, std::string(50, 'c'));
+        file.set(1, std::string(100, 'd'));
+        testTrue(getFileSize(path) == file_size);
+        testTrue(file.getString(1) == std::string(100, 'd'));
+        file.verify();
+        for (uint64_t chunk_id = 0; chunk_id < 3; ++ chunk_id) {
+            file.del(chunk_id);
+        }
+    }
+
+    // Extra capacity should let chunks grow a little
+    {
+        Chunkfile::Options options;
+        options.capacity_policy = Chunkfile::Options::CAPACITY_POWER_OF_TWO;
+        Chunkfile file(path, options);
+        for (uint64_t chunk_id = 0; chunk_id < 3; ++ chunk_id) {
+            file.set(chunk_id, std::string(70, 'a'));
+        }
+        uint64_t file_size = getFileSize(path);
+        for (unsigned size = 60; size < 100; ++ size) {
+            file.set(1, std::string(size, 'b'));
+        }
+        testTrue(getFileSize(path) == file_size);
+        testTrue(file.getString(1) == std::string(99, 'b'));
+        testTrue(file.getChunkSize(1) == 99);
+        file.verify();
+    }
+    {
+        Chunkfile file(path);
+        testTrue(file.getString(0) == std::string(70, 'a'));
+        testTrue(file.getString(1) == std::string(99, 'b'));
+        file.verify();
+        for (uint64_t chunk_id = 0; chunk_id < 3; ++ chunk_id) {
+            file.del(chunk_id);
+        }
+    }
+    testFalse(::remove(path.c_str()));
+
+    // Files of version 0 should still work
+    {
+        std::string old_file_bytes("CHUNKFILE");
+        auto append = [&old_file_bytes](uint64_t value) {
+            for (unsigned i = 0; i < 8; ++ i) {
+                old_file_bytes.push_back(char(value >> (i * 8)));
+            }
+        };
+        // Version, chunks, reserved chunks and empty space
+        append(0);
+        append(2);
+        append(2);
+        append(0);
+        // Header parts
+        append(57);
+        append(76);
+        // Data parts
+        append(19 + (uint64_t(1) << 63));
+        append(0);
+        old_file_bytes += "abc";
+        append(20 + (uint64_t(1) << 63));
+        append(1);
+        old_file_bytes += "defg";
+        std::ofstream old_file(path.c_str(), std::ios::binary);
+        old_file << old_file_bytes;
+    }
+    {
+        Chunkfile::Options options;
+        options.capacity_policy = Chunkfile::Options::CAPACITY_POWER_OF_TWO;
+        Chunkfile file(path, options);
+        file.verify();
+        testTrue(file.getString(0) == std::string("abc"));
+        testTrue(file.getString(1) == std::string("defg"));
+        file.set(0, std::string("xyz"));
+        file.set(1, std::string("long enough to move"));
+        file.set(0, std::string("abcdefghijklmn"));
+        file.set(0, std::string("ab"));
+        testTrue(file.getString(0) == std::string("ab"));
+        testTrue(file.getString(1) == std::string("long enough to move"));
+        file.verify();
+        file.del(0);
+        file.del(1);
+    }
+    {
+        std::ifstream old_file(path.c_str(), std::ios::binary);
+        char header[17];
+        old_file.read(header, 17);
+        testTrue(std::string(header + 9, 8) == std::string(8, '\0'));
+    }
+}
+
+void testMergingFreeSpace(std::string const& path)
+{
+    Chunkfile file(path);
+    for (uint64_t chunk_id = 0; chunk_id < 6; ++ chunk_id) {
+        file.set(chunk_id, std::string(1000, 'a' + chunk_id));
+    }
+    uint64_t file_size = getFileSize(path);
+
+    // Free spaces on both sides should be merged
+    file.del(1);
+    file.del(3);
+    file.del(2);
+    file.verify();
+    file.set(10, std::string(3000, 'x'));
+    testTrue(getFileSize(path) == file_size);
+    file.verify();
+
+    // Free space should be merged before it is removed from the end
+    file.del(4);
+    file.del(10);
+    file.del(5);
+    testTrue(getFileSize(path) < file_size - 5000);
+    testTrue(file.getString(0) == std::string(1000, 'a'));
+    file.verify();
+    file.del(0);
+}
+
+void testCompression(std::string const& path)
+{
+    std::string compressible;
+    for (unsigned i = 0; i < 100000; ++ i) {
+        compressible += "Chunk number " + std::to_string(i % 1000) + ". ";
+    }
+    std::string incompressible;
+    for (unsigned i = 0; i < 100000; ++ i) {
+        incompressible += char(rand());
+    }
+
+    Chunkfile::Options options;
+    options.compression = Chunkfile::Options::COMPRESSION_LZ4;
+
+    // The file is still of version 0, so it can not store compressed chunks
+    {
+        Chunkfile file(path, options);
+        file.set(0, compressible);
+        testTrue(file.getView(0).size == compressible.size());
+        file.del(0);
+    }
+    testFalse(::remove(path.c_str()));
+
+    {
+        Chunkfile file(path, options);
+        file.set(0, compressible);
+        file.set(1, incompressible);
+        file.set(2, "short");
+        file.set(3, "");
+        testTrue(getFileSize(path) < compressible.size() / 2 + incompressible.size());
+        testTrue(file.getString(0) == compressible);
+        testTrue(file.getChunkSize(0) == compressible.size());
+        file.verify();
+
+        // Compressed chunks can not be viewed
+        bool view_failed = false;
+        try {
+            file.getView(0);
+        } catch (std::runtime_error const&) {
+            view_failed = true;
+        }
+        testTrue(view_failed);
+        testTrue(std::string((char const*)file.getView(1).data, file.getView(1).size) == incompressible);
+    }
+
+    // Reading should not need the option
+    {
+        Chunkfile file(path);
+        testTrue(file.getString(0) == compressible);
+        testTrue(file.getString(1) == incompressible);
+        testTrue(file.getString(2) == "short");
+        testTrue(file.getString(3) == "");
+        std::vector<uint8_t> buf(compressible.size());
+        file.get(&buf[0], 0);
+        testTrue(std::string(buf.begin(), buf.end()) == compressible);
+
+        std::vector<uint64_t> chunk_ids;
+        chunk_ids.push_back(0);
+        chunk_ids.push_back(1);
+        std::vector<Chunkfile::Bytes> values;
+        file.getMany(values, chunk_ids);
+        testTrue(std::string(values[0].begin(), values[0].end()) == compressible);
+        testTrue(std::string(values[1].begin(), values[1].end()) == incompressible);
+
+        // Chunks set without the option are not compressed
+        file.set(0, compressible);
+        testTrue(file.getView(0).size == compressible.size());
+        file.verify();
+    }
+
+    // Batch operations should compress too
+    {
+        Chunkfile file(path, options);
+        std::vector<uint64_t> chunk_ids;
+        chunk_ids.push_back(0);
+        chunk_ids.push_back(4);
+        std::vector<Chunkfile::Bytes> values;
+        values.push_back(Chunkfile::Bytes(compressible.begin(), compressible.end()));
+        values.push_back(Chunkfile::Bytes(50000, 'x'));
+        file.setMany(chunk_ids, values);
+        testTrue(getFileSize(path) < compressible.size() / 2 + incompressible.size());
+        testTrue(file.getString(0) == compressible);
+        testTrue(file.getString(4) == std::string(50000, 'x'));
+        file.verify();
+        for (uint64_t chunk_id = 0; chunk_id < 5; ++ chunk_id) {
+            file.del(chunk_id);
+        }
+    }
+}
+
+void testChecksums(std::string const& path)
+{
+    Chunkfile::Options options;
+    options.checksums = true;
+    {
+        Chunkfile file(path, options);
+        for (uint64_t chunk_id = 0; chunk_id < 100; ++ chunk_id) {
+            file.set(chunk_id, std::string(chunk_id * 1000, 'a' + chunk_id % 26));
+        }
+        file.set(100, std::string(10 * 1024 * 1024, 'z') + "unique contents");
+        file.verify(true);
+        file.verify(true, 1);
+        file.verify(true, 16);
+        file.verify(false, 16);
+        testTrue(file.getString(50) == std::string(50000, 'a' + 50 % 26));
+    }
+
+    // Break the contents of the big chunk
+    {
+        std::fstream f(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        size_t pos = contents.find("unique contents");
+        testTrue(pos != std::string::npos);
+        f.seekp(pos);
+        f.write("U", 1);
+    }
+    {
+        Chunkfile file(path, options);
+        file.verify();
+        bool verify_failed = false;
+        try {
+            file.verify(true, 4);
+        } catch (Chunkfile::CorruptedFile const&) {
+            verify_failed = true;
+        }
+        testTrue(verify_failed);
+
+        // Replacing the chunk fixes the file
+        file.set(100, "fixed");
+        file.verify(true);
+        for (uint64_t chunk_id = 0; chunk_id <= 100; ++ chunk_id) {
+            file.del(chunk_id);
+        }
+    }
+}
+
+void testRangedReading(std::string const& path)
+{
+    // Compressed, small and incompressible chunks
+    std::vector<std::string> chunks(3);
+    for (unsigned i = 0; i < 300000; ++ i) {
+        chunks[0] += char('a' + i % 26 + i / 7 % 3);
+        chunks[2] += char(rand());
+    }
+    chunks[1] = chunks[0].substr(0, 60);
+    Chunkfile::Options options;
+    options.compression = Chunkfile::Options::COMPRESSION_LZ4;
+    Chunkfile file(path, options);
+    for (uint64_t chunk_id = 0; chunk_id < 3; ++ chunk_id) {
+        file.set(chunk_id, chunks[chunk_id]);
+    }
+    testTrue(file.getView(1).size == 60);
+    testTrue(file.getView(2).size == 300000);
+
+    for (uint64_t chunk_id = 0; chunk_id < 3; ++ chunk_id) {
+        std::string const& chunk = chunks[chunk_id];
+
+        // Ranges that go past the end are cut
+        uint8_t buf[1000];
+        testTrue(file.read(buf, chunk_id, 10, 30) == 30);
+        testTrue(std::string((char const*)buf, 30) == chunk.substr(10, 30));
+        testTrue(file.read(buf, chunk_id, chunk.size() - 20, 1000) == 20);
+        testTrue(std::string((char const*)buf, 20) == chunk.substr(chunk.size() - 20));
+        testTrue(file.read(buf, chunk_id, chunk.size() + 20, 1000) == 0);
+        Chunkfile::Bytes bytes;
+        file.read(bytes, chunk_id, 40, 1000000);
+        testTrue(std::string(bytes.begin(), bytes.end()) == chunk.substr(40));
+
+        // Read with pieces of different sizes
+        Chunkfile::Reader reader = file.getReader(chunk_id, 1000);
+        testTrue(reader.getSize() == chunk.size());
+        std::string read_contents;
+        uint64_t piece_size = 1;
+        while (uint64_t read_size = reader.read(buf, piece_size)) {
+            read_contents.append((char const*)buf, read_size);
+            piece_size = piece_size * 3 % 1000 + 1;
+        }
+        testTrue(read_contents == chunk);
+        testTrue(reader.getPosition() == chunk.size());
+
+        // Seeking and reading past the buffer size
+        reader.seek(5);
+        std::vector<uint8_t> big(5000);
+        testTrue(reader.read(&big[0], big.size()) == std::min<uint64_t>(big.size(), chunk.size() - 5));
+        testTrue(std::string(big.begin(), big.begin() + 50) == chunk.substr(5, 50));
+        reader.seek(1);
+        testTrue(reader.read(buf, 4) == 4);
+        testTrue(std::string((char const*)buf, 4) == chunk.substr(1, 4));
+    }
+
+    for (uint64_t chunk_id = 0; chunk_id < 3; ++ chunk_id) {
+        file.del(chunk_id);
+    }
+}
+
+void testPartialWriting(std::string const& path)
+{
+    Chunkfile::Options options;
+    options.checksums = true;
+    unsigned writes = 0;
+    CountingBackend* backend = new CountingBackend(path, &writes);
+    Chunkfile file(backend, options);
+
+    // Appending should not rewrite the whole chunk every time. The
+    // other chunk keeps the first one from being at the end of file.
+    std::string log;
+    file.set(0, "");
+    file.set(1, "after");
+    backend->bytes_written = 0;
+    for (unsigned i = 0; i < 1000; ++ i) {
+        std::string record = "Record " + std::to_string(i) + "\n";
+        file.append(0, record);
+        log += record;
+    }
+    testTrue(file.getString(0) == log);
+    testTrue(backend->bytes_written < log.size() * 10);
+    file.verify(true);
+
+    // Overwriting should only write the changed bytes
+    backend->bytes_written = 0;
+    file.write(0, 100, "changed");
+    log.replace(100, 7, "changed");
+    testTrue(backend->bytes_written < 100);
+    testTrue(file.getString(0) == log);
+    file.write(0, log.size() - 3, "grown");
+    log.replace(log.size() - 3, 3, "grown");
+    testTrue(file.getString(0) == log);
+    testTrue(file.getString(1) == "after");
+    file.verify(true);
+
+    // Offset must not be past the end
+    bool write_failed = false;
+    try {
+        file.write(1, 6, "x");
+    } catch (std::runtime_error const&) {
+        write_failed = true;
+    }
+    testTrue(write_failed);
+    file.write(1, 5, "x");
+    testTrue(file.getString(1) == "afterx");
+
+    file.del(0);
+    file.del(1);
+}
+
+void testIterating(std::string const& path)
+{
+    Chunkfile::Options options;
+    options.compression = Chunkfile::Options::COMPRESSION_LZ4;
+    Chunkfile file(path, options);
+    std::map<uint64_t, std::string> chunks;
+    for (uint64_t chunk_id = 0; chunk_id < 200; ++ chunk_id) {
+        chunks[chunk_id * 7 % 200] = std::string(chunk_id * 20, 'a' + chunk_id % 26);
+    }
+    for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+        file.set(it->first, it->second);
+    }
+    // Leave some free space between chunks
+    for (uint64_t chunk_id = 0; chunk_id < 200; chunk_id += 3) {
+        file.del(chunk_id);
+        chunks.erase(chunk_id);
+    }
+
+    // Both big and small buffers
+    for (uint64_t buffer_size = 1; buffer_size <= 1024 * 1024; buffer_size *= 1024) {
+        Chunkfile::Iterator it = file.getIterator(buffer_size);
+        std::map<uint64_t, std::string> found;
+        uint64_t chunk_id;
+        Chunkfile::Bytes contents;
+        while (it.next(chunk_id, contents)) {
+            testFalse(found.count(chunk_id));
+            found[chunk_id] = std::string(contents.begin(), contents.end());
+        }
+        testTrue(found == chunks);
+        testFalse(it.next(chunk_id, contents));
+    }
+
+    for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+        file.del(it->first);
+    }
+    uint64_t chunk_id;
+    Chunkfile::Bytes contents;
+    testFalse(file.getIterator().next(chunk_id, contents));
+}
+
+void testStatistics(std::string const& path)
+{
+    Chunkfile file(path);
+    Chunkfile::Stats stats = file.getStats();
+    testTrue(stats.writes == 0);
+    testTrue(stats.bytes_set == 0);
+
+    for (uint64_t chunk_id = 0; chunk_id < 100; ++ chunk_id) {
+        file.set(chunk_id, std::string(1000, 'a'));
+    }
+    stats = file.getStats();
+    testTrue(stats.writes > 0);
+    testTrue(stats.bytes_set == 100 * 1000);
+    testTrue(stats.bytes_written > stats.bytes_set);
+    testTrue(stats.write_amplification > 1);
+    testTrue(stats.reserve_growths > 0);
+    testTrue(stats.chunks == 100);
+    testTrue(stats.file_size == getFileSize(path));
+    testTrue(stats.live_bytes >= 100 * 1000);
+
+    uint64_t reads = stats.reads;
+    uint64_t bytes_read = stats.bytes_read;
+    testTrue(file.getString(50) == std::string(1000, 'a'));
+    stats = file.getStats();
+    testTrue(stats.reads > reads);
+    testTrue(stats.bytes_read >= bytes_read + 1000);
+    testTrue(stats.seeks > 0);
+
+    // Removing every other chunk fragments the file
+    for (uint64_t chunk_id = 0; chunk_id < 100; chunk_id += 2) {
+        file.del(chunk_id);
+    }
+    stats = file.getStats();
+    testTrue(stats.empty_space > 0);
+    testTrue(stats.fragmentation > 0.3 && stats.fragmentation < 0.7);
+    uint64_t data_part_moves = stats.data_part_moves;
+    file.optimize();
+    stats = file.getStats();
+    testTrue(stats.optimizations > 0);
+    testTrue(stats.data_part_moves > data_part_moves);
+    testTrue(stats.fragmentation == 0);
+
+    for (uint64_t chunk_id = 1; chunk_id < 100; chunk_id += 2) {
+        file.del(chunk_id);
+    }
+}
+
+void testSparseIds(std::string const& path)
+{
+    // Sparse IDs are only used when the file is created
+    testFalse(::remove(path.c_str()));
+    Chunkfile::Options options;
+    options.sparse_ids = true;
+
+    // Both huge and successive IDs
+    std::map<uint64_t, std::string> chunks;
+    for (uint64_t i = 0; i < 500; ++ i) {
+        uint64_t chunk_id = i % 2 ? i : i * 0x9e3779b97f4a7c15ULL;
+        chunks[chunk_id] = std::string(i % 50, 'a' + i % 26);
+    }
+    chunks[uint64_t(-2)] = "last";
+    {
+        Chunkfile file(path, options);
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            file.set(it->first, it->second);
+        }
+        testFalse(file.exists(1000000000));
+        testTrue(file.getChunkSize(uint64_t(-2)) == 4);
+        file.verify();
+
+        // The biggest ID is reserved for marking empty slots
+        bool setting_failed = false;
+        try {
+            file.set(uint64_t(-1), "x");
+        } catch (std::runtime_error const&) {
+            setting_failed = true;
+        }
+        testTrue(setting_failed);
+        // Header area grows with the chunks only
+        testTrue(getFileSize(path) < 200 * 1024);
+
+        bool allocating_failed = false;
+        try {
+            file.allocateId();
+        } catch (std::runtime_error const&) {
+            allocating_failed = true;
+        }
+        testTrue(allocating_failed);
+    }
+
+    // Chunks are found after reopening, with and without cache
+    for (unsigned cache = 0; cache < 2; ++ cache) {
+        options.cache_header_parts = cache;
+        Chunkfile file(path, options);
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            testTrue(file.getString(it->first) == it->second);
+        }
+        uint64_t chunk_id;
+        Chunkfile::Bytes contents;
+        Chunkfile::Iterator it = file.getIterator();
+        size_t found = 0;
+        while (it.next(chunk_id, contents)) {
+            testTrue(std::string(contents.begin(), contents.end()) == chunks[chunk_id]);
+            ++ found;
+        }
+        testTrue(found == chunks.size());
+        file.verify();
+    }
+
+    // Removing chunks must keep the rest of them findable
+    {
+        Chunkfile file(path, options);
+        uint64_t full_size = getFileSize(path);
+        std::vector<uint64_t> chunk_ids;
+        for (std::map<uint64_t, std::string>::iterator it = chunks.begin(); it != chunks.end(); ) {
+            if (it->first % 3 == 0) {
+                chunk_ids.push_back(it->first);
+                it = chunks.erase(it);
+            } else {
+                ++ it;
+            }
+        }
+        file.delMany(chunk_ids);
+        for (uint64_t i = 0; i < 500; i += 2) {
+            uint64_t chunk_id = i * 0x9e3779b97f4a7c15ULL;
+            if (chunks.erase(chunk_id)) {
+                file.del(chunk_id);
+            }
+        }
+        file.verify();
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            testTrue(file.getString(it->first) == it->second);
+        }
+        for (uint64_t i = 0; i < 500; i += 3) {
+            testFalse(file.exists(i * 0x9e3779b97f4a7c15ULL));
+        }
+
+        // Batches
+        chunk_ids.assign(1, 123456789012345ULL);
+        chunk_ids.push_back(1);
+        std::vector<Chunkfile::Bytes> values(2, Chunkfile::Bytes(10, 'x'));
+        file.setMany(chunk_ids, values);
+        chunks[1] = chunks[123456789012345ULL] = std::string(10, 'x');
+        std::vector<Chunkfile::Bytes> results;
+        file.getMany(results, chunk_ids);
+        testTrue(results == values);
+
+        // Hash table shrinks when chunks are removed
+        file.optimize();
+        file.verify();
+        testTrue(getFileSize(path) < full_size / 2);
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            file.del(it->first);
+        }
+        file.optimize();
+        file.verify();
+    }
+    testTrue(getFileSize(path) == 41);
+}
+
+void testDeduplication(std::string const& path)
+{
+    Chunkfile::Options options;
+
+    // Unique contents take only the space of their hash more than without
+    // deduplication, and they are modified in place
+    std::string unique(10000, 'u');
+    uint64_t unique_file_sizes[2];
+    for (unsigned dedup = 0; dedup < 2; ++ dedup) {
+        testFalse(::remove(path.c_str()));
+        options.deduplication = dedup;
+        Chunkfile file(path, options);
+        file.set(0, unique);
+        unique_file_sizes[dedup] = getFileSize(path);
+        Chunkfile::Stats stats = file.getStats();
+        file.write(0, 5000, "changed");
+        testTrue(file.getStats().bytes_written - stats.bytes_written < 100);
+        file.verify(true);
+    }
+    testTrue(unique_file_sizes[1] <= unique_file_sizes[0] + 8);
+
+    // Deduplication is only used when the file is created
+    testFalse(::remove(path.c_str()));
+    options.deduplication = true;
+
+    // Many chunks have the same contents
+    std::string templ(10000, 't');
+    for (size_t i = 0; i < templ.size(); i += 7) {
+        templ[i] = i % 251;
+    }
+    std::string other(5000, 'o');
+    std::map<uint64_t, std::string> chunks;
+    for (uint64_t chunk_id = 0; chunk_id < 100; ++ chunk_id) {
+        chunks[chunk_id] = chunk_id % 10 == 0 ? other : templ;
+    }
+    // Small chunks are not shared
+    chunks[100] = chunks[101] = "small";
+    {
+        Chunkfile file(path, options);
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            file.set(it->first, it->second);
+        }
+        file.verify(true);
+        testTrue(getFileSize(path) < templ.size() + other.size() + 10000);
+        Chunkfile::Stats stats = file.getStats();
+        testTrue(stats.bytes_deduplicated == 89 * templ.size() + 9 * other.size());
+        testTrue(stats.bytes_written * 10 < stats.bytes_set);
+
+        testTrue(file.getString(5) == templ);
+        testTrue(file.getChunkSize(10) == other.size());
+        Chunkfile::Bytes bytes;
+        file.read(bytes, 7, 9990, 100);
+        testTrue(std::string(bytes.begin(), bytes.end()) == templ.substr(9990));
+        Chunkfile::View view = file.getView(20);
+        testTrue(std::string((char const*)view.data, view.size) == other);
+        std::vector<uint64_t> chunk_ids;
+        chunk_ids.push_back(30);
+        chunk_ids.push_back(31);
+        chunk_ids.push_back(100);
+        std::vector<Chunkfile::Bytes> results;
+        file.getMany(results, chunk_ids);
+        testTrue(std::string(results[0].begin(), results[0].end()) == other);
+        testTrue(std::string(results[1].begin(), results[1].end()) == templ);
+        testTrue(std::string(results[2].begin(), results[2].end()) == "small");
+
+        // Modifying a chunk does not change the others
+        file.append(1, "appended");
+        chunks[1] += "appended";
+        file.write(2, 0, "written");
+        chunks[2].replace(0, 7, "written");
+        file.set(3, other);
+        chunks[3] = other;
+        std::vector<Chunkfile::Bytes> values(2, Chunkfile::Bytes(templ.begin(), templ.end()));
+        chunk_ids.assign(1, 10);
+        chunk_ids.push_back(200);
+        file.setMany(chunk_ids, values);
+        chunks[10] = chunks[200] = templ;
+        file.verify(true);
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            testTrue(file.getString(it->first) == it->second);
+        }
+    }
+
+    // Shared contents are found after reopening, and are returned
+    // by iterator only with the chunks that use them
+    for (unsigned cache = 0; cache < 2; ++ cache) {
+        options.cache_header_parts = cache;
+        Chunkfile file(path, options);
+        file.verify(true);
+        uint64_t chunk_id;
+        Chunkfile::Bytes contents;
+        Chunkfile::Iterator it = file.getIterator(1000);
+        size_t found = 0;
+        while (it.next(chunk_id, contents)) {
+            testTrue(std::string(contents.begin(), contents.end()) == chunks[chunk_id]);
+            ++ found;
+        }
+        testTrue(found == chunks.size());
+    }
+
+    // Shared contents are freed with the last chunk that uses them
+    {
+        Chunkfile file(path, options);
+        // Contents that are not shared yet are found after reopening
+        file.set(300, chunks[1]);
+        chunks[300] = chunks[1];
+        testTrue(file.getStats().bytes_deduplicated == chunks[1].size());
+        file.verify(true);
+        std::vector<uint64_t> chunk_ids;
+        for (uint64_t chunk_id = 0; chunk_id < 100; chunk_id += 2) {
+            chunk_ids.push_back(chunk_id);
+            chunks.erase(chunk_id);
+        }
+        file.delMany(chunk_ids);
+        file.verify();
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            testTrue(file.getString(it->first) == it->second);
+        }
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            if (it->second != templ) {
+                file.del(it->first);
+            }
+        }
+        file.optimize();
+        file.verify(true);
+        testTrue(getFileSize(path) < templ.size() + 10000);
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            if (it->second == templ) {
+                testTrue(file.getString(it->first) == templ);
+                file.del(it->first);
+            }
+        }
+        file.optimize();
+        file.verify();
+    }
+    testTrue(getFileSize(path) == 41);
+}
+
+void testSharding(std::string const& path)
+{
+    std::string dir = path + "_shards";
+    ShardedChunkfile::Options options;
+
+    // Invalid options leave nothing behind
+    options.shards = 0;
+    bool opening_failed = false;
+    try {
+        ShardedChunkfile file(dir, options);
+    } catch (std::runtime_error const&) {
+        opening_failed = true;
+    }
+    testTrue(opening_failed);
+    testTrue(::access(dir.c_str(), F_OK) != 0);
+
+    options.shards = 3;
+    std::map<uint64_t, std::string> chunks;
+    {
+        ShardedChunkfile file(dir, options);
+        testTrue(file.getShardCount() == 3);
+        for (uint64_t chunk_id = 0; chunk_id < 300; ++ chunk_id) {
+            chunks[chunk_id] = std::string(chunk_id % 100, 'a' + chunk_id % 26);
+            file.set(chunk_id, chunks[chunk_id]);
+        }
+        // Chunks are spread to all shards
+        for (unsigned index = 0; index < file.getShardCount(); ++ index) {
+            testTrue(file.getShard(index).getStats().chunks > 50);
+        }
+        testTrue(file.getStats().chunks == 300);
+        file.verify(true);
+    }
+
+    // Shards can be written from multiple threads at the same time
+    options.shards = 5;
+    {
+        ShardedChunkfile file(dir, options);
+        testTrue(file.getShardCount() == 3);
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < 4; ++ i) {
+            threads.push_back(std::thread([&file, i]() {
+                for (uint64_t chunk_id = 1000 + i; chunk_id < 2000; chunk_id += 4) {
+                    file.set(chunk_id, std::to_string(chunk_id));
+                }
+            }));
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        for (uint64_t chunk_id = 1000; chunk_id < 2000; ++ chunk_id) {
+            chunks[chunk_id] = std::to_string(chunk_id);
+        }
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            testTrue(file.getString(it->first) == it->second);
+        }
+
+        // Batches are split to shards
+        std::vector<uint64_t> chunk_ids;
+        std::vector<Chunkfile::Bytes> values;
+        for (uint64_t chunk_id = 0; chunk_id < 3000; chunk_id += 7) {
+            chunk_ids.push_back(chunk_id);
+            values.push_back(Chunkfile::Bytes(chunk_id % 50, chunk_id));
+            chunks[chunk_id] = std::string(values.back().begin(), values.back().end());
+        }
+        file.setMany(chunk_ids, values);
+        std::vector<Chunkfile::Bytes> results;
+        file.getMany(results, chunk_ids);
+        testTrue(results == values);
+        chunk_ids.clear();
+        for (std::map<uint64_t, std::string>::iterator it = chunks.begin(); it != chunks.end(); ) {
+            if (it->first % 2 == 0) {
+                chunk_ids.push_back(it->first);
+                it = chunks.erase(it);
+            } else {
+                ++ it;
+            }
+        }
+        file.delMany(chunk_ids);
+        for (uint64_t chunk_id = 0; chunk_id < 3000; ++ chunk_id) {
+            testTrue(file.exists(chunk_id) == (chunks.count(chunk_id) > 0));
+        }
+        bool getting_failed = false;
+        try {
+            file.getMany(results, chunk_ids);
+        } catch (Chunkfile::ChunkDoesNotExist const&) {
+            getting_failed = true;
+        }
+        testTrue(getting_failed);
+
+        // Nothing is removed from any shard if some chunk does not exist
+        std::vector<uint64_t> existing_chunk_ids;
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            existing_chunk_ids.push_back(it->first);
+        }
+        existing_chunk_ids.push_back(chunk_ids.front());
+        bool removing_failed = false;
+        try {
+            file.delMany(existing_chunk_ids);
+        } catch (Chunkfile::ChunkDoesNotExist const&) {
+            removing_failed = true;
+        }
+        testTrue(removing_failed);
+        testTrue(file.getStats().chunks == chunks.size());
+        file.optimize();
+        file.verify(true);
+
+        for (std::map<uint64_t, std::string>::const_iterator it = chunks.begin(); it != chunks.end(); ++ it) {
+            file.del(it->first);
+        }
+    }
+    for (unsigned index = 0; index < 3; ++ index) {
+        testFalse(::remove((dir + "/shard" + std::to_string(index)).c_str()));
+    }
+    testFalse(::remove((dir + "/shards").c_str()));
+    testFalse(::remove(dir.c_str()));
+
+    // Ranges of IDs
+    options.shards = 3;
+    options.partitioning = ShardedChunkfile::Options::PARTITION_RANGE;
+    options.range_size = 100;
+    options.chunkfile.backend = Chunkfile::Options::BACKEND_MEMORY;
+    ShardedChunkfile file("", options);
+    testTrue(file.getShardIndex(0) == 0);
+    testTrue(file.getShardIndex(99) == 0);
+    testTrue(file.getShardIndex(100) == 1);
+    testTrue(file.getShardIndex(250) == 2);
+    testTrue(file.getShardIndex(1000000) == 2);
+    file.set(150, "abc");
+    testTrue(file.getShard(1).exists(150));
+    testTrue(file.getString(150) == "abc");
+}
+
 void testFileRemoval(std::string const& path)
 {
     testFalse(::remove(path.c_str()));
@@ -245,6 +1757,98 @@ int main()
     testRemovingChunks(path);
     std::cout << "Passed!" << std::endl;
 
+    std::cout << "Test reusing free space..." << std::endl;
+    testReusingFreeSpace(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test optimizing data parts..." << std::endl;
+    testOptimizingDataParts(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test caching header parts..." << std::endl;
+    testCachingHeaderParts(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test views..." << std::endl;
+    testViews(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test write ahead log..." << std::endl;
+    testWriteAheadLog(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test batch operations..." << std::endl;
+    testBatchOperations(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test backends..." << std::endl;
+    testBackends(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test concurrent reading..." << std::endl;
+    testConcurrentReading(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test async operations..." << std::endl;
+    testAsyncOperations(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test releasing disk space..." << std::endl;
+    testReleasingDiskSpace(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test write back buffering..." << std::endl;
+    testWriteBackBuffering(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test allocating ids..." << std::endl;
+    testAllocatingIds(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test overwriting in place..." << std::endl;
+    testOverwritingInPlace(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test merging free space..." << std::endl;
+    testMergingFreeSpace(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test compression..." << std::endl;
+    testCompression(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test checksums..." << std::endl;
+    testChecksums(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test ranged reading..." << std::endl;
+    testRangedReading(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test partial writing..." << std::endl;
+    testPartialWriting(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test iterating..." << std::endl;
+    testIterating(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test statistics..." << std::endl;
+    testStatistics(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test sparse ids..." << std::endl;
+    testSparseIds(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test deduplication..." << std::endl;
+    testDeduplication(path);
+    std::cout << "Passed!" << std::endl;
+
+    std::cout << "Test sharding..." << std::endl;
+    testSharding(path);
+    std::cout << "Passed!" << std::endl;
+
     std::cout << "Test file removal..." << std::endl;
     testFileRemoval(path);
     std::cout << "Passed!" << std::endl;